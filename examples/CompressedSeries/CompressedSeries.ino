@@ -0,0 +1,41 @@
+#include <EEPROMWearLevel.h>
+
+#define EEPROM_LAYOUT_VERSION 0
+#define AMOUNT_OF_INDEXES 1
+#define INDEX_SERIES 0
+#define KEYFRAME_INTERVAL 16
+#define MAX_VALUES 20
+
+SeriesEncoder encoder(KEYFRAME_INTERVAL);
+
+void setup() {
+  Serial.begin(9600);
+  while (!Serial);
+
+  EEPROMwl.begin(EEPROM_LAYOUT_VERSION, AMOUNT_OF_INDEXES, 64);
+
+  writeData();
+  readData();
+}
+
+void loop() {
+}
+
+void writeData() {
+  // slowly changing values only need one byte each
+  long temperature = 2150;
+  for (int i = 0; i < 10; i++) {
+    temperature += i % 3 - 1;
+    EEPROMwl.putSample(INDEX_SERIES, encoder, temperature);
+  }
+}
+
+void readData() {
+  long values[MAX_VALUES];
+  int count = EEPROMwl.getSamples(INDEX_SERIES, values, MAX_VALUES);
+  for (int i = 0; i < count; i++) {
+    Serial.print(i);
+    Serial.print(F(": "));
+    Serial.println(values[i]);
+  }
+}
@@ -0,0 +1,41 @@
+#include <EEPROMWearLevel.h>
+
+#define EEPROM_LAYOUT_VERSION 0
+// the key-value store uses two indexes
+#define AMOUNT_OF_INDEXES 2
+#define INDEX_KEY_VALUE 0
+#define MAX_KEYS 8
+
+void setup() {
+  Serial.begin(9600);
+  while (!Serial);
+
+  EEPROMwl.begin(EEPROM_LAYOUT_VERSION, AMOUNT_OF_INDEXES);
+  EEPROMwl.beginKeyValue(INDEX_KEY_VALUE, MAX_KEYS);
+
+  writeConfiguration();
+  readConfiguration();
+}
+
+void loop() {
+}
+
+void writeConfiguration() {
+  byte brightness = 12;
+  EEPROMwl.putKey("brightness", brightness);
+
+  long timeout = 33333;
+  EEPROMwl.putKey("timeout", timeout);
+}
+
+void readConfiguration() {
+  byte brightness = 0;
+  EEPROMwl.getKey("brightness", brightness);
+  Serial.print(F("brightness: "));
+  Serial.println(brightness);
+
+  long timeout = -1;
+  EEPROMwl.getKey("timeout", timeout);
+  Serial.print(F("timeout: "));
+  Serial.println(timeout);
+}
@@ -3,17 +3,48 @@
 
 EEPROMWearLevel EEPROMwl;
 
+/**
+   every key-value record starts with 2 bytes key hash, 1 byte key check and 1 byte length
+*/
+#define KEY_VALUE_HEADER_LENGTH 4
+#define KEY_VALUE_CHECK_OFFSET 2
+#define KEY_VALUE_LENGTH_OFFSET 3
+/**
+   the budget of compactKeyValues() when putKey() needs the space immediately
+*/
+#define KEY_VALUE_NO_BUDGET 0xFFFFFFFFUL
+
 EEPROMWearLevel::EEPROMWearLevel() {
 	amountOfIndexes = 0;
+	eepromConfig = NULL;
+	repairQueueLength = 0;
+	keyValueIdx = NO_KEY_VALUE;
+	keyValueRegion = 0;
+	keyValueGeneration = 0;
+	keyValueCompacting = false;
+	keyValueClearedControlBytes = 0;
+	keyValueWrittenFromIndex = NO_DATA;
+	keyValueWrittenLength = 0;
+	keyValueEntries = NULL;
+	keyValueTableSize = 0;
+	keyValueMaxKeys = 0;
+	keyValueKeyCount = 0;
 #ifdef NO_EEPROM_WRITES
 	for (int i = 0; i < FAKE_EEPROM_SIZE; i++) {
 		fakeEeprom[i] = 0xFF;
 	}
+	fakeOperationsUntilPowerLoss = NO_POWER_LOSS;
+	resetOperationCounts();
 #endif
 }
 
 void EEPROMWearLevel::begin(const byte layoutVersion, const int amountOfIndexes) {
+#ifndef NO_EEPROM_WRITES
 	begin(layoutVersion, amountOfIndexes, EEPROMClass::length());
+#else
+	// -1 because index 0 is reserved for the version
+	begin(layoutVersion, amountOfIndexes, FAKE_EEPROM_SIZE - 1);
+#endif
 }
 
 void EEPROMWearLevel::begin(const byte layoutVersion, const int amountOfIndexes, const int eepromLengthToUse) {
@@ -21,6 +52,8 @@ void EEPROMWearLevel::begin(const byte layoutVersion, const int amountOfIndexes,
 	EEPROMWearLevel::amountOfIndexes = amountOfIndexes;
 	// +1 to store a place holder element in the last
 	// place to get the lenth of the last element
+	// delete the previous one in case begin() is called again
+	delete[] eepromConfig;
 	eepromConfig = new EEPROMConfig[amountOfIndexes + 1];
 	const int singleLength = eepromLengthToUse / amountOfIndexes;
 	int index;
@@ -39,6 +72,8 @@ void EEPROMWearLevel::begin(const byte layoutVersion, const int lengths[], const
 	EEPROMWearLevel::amountOfIndexes = amountOfIndexes;
 	// +1 to store a place holder element in the last
 	// place to get the lenth of the last element
+	// delete the previous one in case begin() is called again
+	delete[] eepromConfig;
 	eepromConfig = new EEPROMConfig[amountOfIndexes + 1];
 	int index;
 	for (index = 0; index < amountOfIndexes; index++) {
@@ -56,7 +91,7 @@ void EEPROMWearLevel::init(const byte layoutVersion) {
 #ifndef NO_EEPROM_WRITES
 	EEPROMClass::update(INDEX_VERSION, layoutVersion);
 #else
-	fakeEeprom[INDEX_VERSION] = layoutVersion;
+	fakeWriteByte(INDEX_VERSION, layoutVersion);
 #endif
 
 	// -1 because the last one is a placeholder
@@ -68,9 +103,22 @@ void EEPROMWearLevel::init(const byte layoutVersion) {
 		}
 
 		eepromConfig[index].lastIndexRead = findIndex(eepromConfig[index], controlBytesCount);
+		eepromConfig[index].lastDataLength = 0;
+		eepromConfig[index].rotations = 0;
+		eepromConfig[index].rotationCounterIdx = NO_ROTATION_COUNTER;
+		eepromConfig[index].series = false;
 	}
 	// the last one as a placeholder to calculate the length of the last real element
 	eepromConfig[index].lastIndexRead = NO_DATA;
+	eepromConfig[index].lastDataLength = 0;
+	eepromConfig[index].rotations = 0;
+	eepromConfig[index].rotationCounterIdx = NO_ROTATION_COUNTER;
+	eepromConfig[index].series = false;
+
+	// beginKeyValue() needs to be called again after begin()
+	keyValueIdx = NO_KEY_VALUE;
+	// the queued repairs might refer to the previous layout
+	repairQueueLength = 0;
 
 	// prevent warning about not using EEPROM
 	(void)EEPROM;
@@ -111,6 +159,192 @@ void EEPROMWearLevel::write(const int idx, const uint8_t val) {
 	put(idx, val, false);
 }
 
+bool EEPROMWearLevel::getBytes(const int idx, byte *values, const int dataLength) {
+#ifndef NO_RANGE_CHECK
+	if (idx >= amountOfIndexes) {
+		logOutOfRange(idx);
+		return false;
+	}
+#endif
+	const int lastIndex = eepromConfig[idx].lastIndexRead;
+	if (lastIndex == NO_DATA) {
+#ifdef DEBUG_LOG
+		Serial.println(F("no data"));
+#endif
+		return false;
+	}
+	// +1 because it is the last index
+	const int firstIndex = lastIndex + 1 - dataLength;
+	for (int i = 0; i < dataLength; i++) {
+		values[i] = readByte(firstIndex + i);
+	}
+	return true;
+}
+
+void EEPROMWearLevel::putBytes(const int idx, const byte *values, const int dataLength, const bool update) {
+#ifndef NO_RANGE_CHECK
+	if (idx >= amountOfIndexes) {
+		logOutOfRange(idx);
+		return;
+	}
+#endif
+	const int controlBytesCount = getControlBytesCount(idx);
+
+	const int writeStartIndex = getWriteStartIndex(idx, dataLength, values, update, controlBytesCount);
+	if (writeStartIndex < 0) {
+		return;
+	}
+	// a repair in progress would mix the bytes of the previous and the new value
+	dequeueRepairs(idx);
+	writeBytes(writeStartIndex, values, dataLength);
+	updateControlBytes(idx, writeStartIndex, dataLength, controlBytesCount);
+}
+
+bool EEPROMWearLevel::getRedundantBytes(const int idx, const int copies, byte *values, const int dataLength) {
+	// -1 because the last byte is the checksum
+	const int valueLength = dataLength - 1;
+	int validCopy;
+	for (validCopy = 0; validCopy < copies; validCopy++) {
+		if (getBytes(idx + validCopy, values, dataLength)
+		        && checksum(values, valueLength) == values[valueLength]) {
+			break;
+		}
+#ifdef DEBUG_LOG
+		Serial.print(F("invalid copy: "));
+		Serial.println(idx + validCopy);
+#endif
+	}
+	if (validCopy >= copies) {
+		return false;
+	}
+	// repair the invalid copies read before in maintain()
+	for (int copy = 0; copy < validCopy; copy++) {
+		queueRepair(idx + validCopy, idx + copy, dataLength);
+	}
+	return true;
+}
+
+void EEPROMWearLevel::queueRepair(const int sourceIdx, const int targetIdx, const int dataLength) {
+	for (int i = 0; i < repairQueueLength; i++) {
+		if (repairQueue[i].targetIdx == targetIdx) {
+			// already queued
+			return;
+		}
+	}
+	if (repairQueueLength >= REPAIR_QUEUE_LENGTH) {
+#ifdef DEBUG_LOG
+		Serial.println(F("repair queue full"));
+#endif
+		return;
+	}
+	RepairEntry &entry = repairQueue[repairQueueLength];
+	entry.sourceIdx = sourceIdx;
+	entry.targetIdx = targetIdx;
+	entry.dataLength = dataLength;
+	entry.writeStartIndex = NO_DATA;
+	entry.writtenLength = 0;
+	repairQueueLength++;
+}
+
+void EEPROMWearLevel::dequeueRepairs(const int idx) {
+	int length = 0;
+	for (int i = 0; i < repairQueueLength; i++) {
+		if (repairQueue[i].sourceIdx != idx && repairQueue[i].targetIdx != idx) {
+			repairQueue[length] = repairQueue[i];
+			length++;
+		}
+	}
+	repairQueueLength = length;
+}
+
+bool EEPROMWearLevel::isRepairInProgress(const int idx) const {
+	for (int i = 0; i < repairQueueLength; i++) {
+		if (repairQueue[i].targetIdx == idx && repairQueue[i].writeStartIndex != NO_DATA) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool EEPROMWearLevel::repairCopies(const unsigned long startMicros, const unsigned long budgetMicros) {
+	while (repairQueueLength > 0) {
+		RepairEntry &entry = repairQueue[repairQueueLength - 1];
+		const int lastIndex = eepromConfig[entry.sourceIdx].lastIndexRead;
+		const EEPROMConfig &config = eepromConfig[entry.targetIdx];
+		const int controlBytesCount = getControlBytesCount(entry.targetIdx);
+		const int startIndexData = config.startIndexControlBytes + controlBytesCount;
+		if (lastIndex == NO_DATA) {
+			repairQueueLength--;
+			continue;
+		}
+		if (entry.writeStartIndex == NO_DATA) {
+			// starting again at the beginning might clear the control bytes
+			if (micros() - startMicros + controlBytesCount * (unsigned long) EEPROM_ERASE_MICROS > budgetMicros) {
+				return false;
+			}
+			// values are only used for update so they can be NULL
+			entry.writeStartIndex = getWriteStartIndex(entry.targetIdx, entry.dataLength, NULL, false, controlBytesCount);
+			if (entry.writeStartIndex < 0) {
+				repairQueueLength--;
+				continue;
+			}
+		}
+		// started again at the beginning without clearing the control bytes yet
+		const bool wrapAround = config.lastIndexRead != NO_DATA && entry.writeStartIndex <= config.lastIndexRead;
+		// -1 because it is the last index
+		const int lastControlByteIndex = config.startIndexControlBytes
+		                                 + (entry.writeStartIndex + entry.dataLength - 1 - startIndexData) / 8;
+		if (wrapAround && entry.writtenLength == 0) {
+			// clear the control bytes of the new data now like updateControlBytes() does
+			// first. The previous position stays in a later control byte.
+			clearBytesToOnes(config.startIndexControlBytes, lastControlByteIndex + 1 - config.startIndexControlBytes);
+		}
+		// one byte per budget check. They are only marked as used after the
+		// last one so a power loss in between does no harm.
+		// +1 because it is the last index
+		const int fromIndex = lastIndex + 1 - entry.dataLength;
+		for (; entry.writtenLength < entry.dataLength; entry.writtenLength++) {
+			// the byte might need an erase and a write
+			if (micros() - startMicros + 2UL * EEPROM_ERASE_MICROS > budgetMicros) {
+				return false;
+			}
+			const byte value = readByte(fromIndex + entry.writtenLength);
+			writeBytes(entry.writeStartIndex + entry.writtenLength, &value, 1);
+		}
+		unsigned long markMicros = getMarkMicros(entry.dataLength);
+		if (wrapAround) {
+			// updateControlBytes() clears the control bytes after the new data
+			for (int index = lastControlByteIndex + 1; index < startIndexData; index++) {
+				if (readByte(index) != 0xFF) {
+					markMicros += EEPROM_ERASE_MICROS;
+				}
+			}
+		}
+		if (micros() - startMicros + markMicros > budgetMicros) {
+			return false;
+		}
+		updateControlBytes(entry.targetIdx, entry.writeStartIndex, entry.dataLength, controlBytesCount);
+		repairQueueLength--;
+	}
+	return true;
+}
+
+byte EEPROMWearLevel::checksum(const byte *values, const int length) const {
+	// CRC-8 with polynomial x^8 + x^2 + x + 1
+	byte crc = 0;
+	for (int i = 0; i < length; i++) {
+		crc ^= values[i];
+		for (int bit = 0; bit < 8; bit++) {
+			if ((crc & 0x80) != 0) {
+				crc = (crc << 1) ^ 0x07;
+			} else {
+				crc <<= 1;
+			}
+		}
+	}
+	return crc;
+}
+
 int EEPROMWearLevel::getStartIndexEEPROM(const int idx) {
 #ifndef NO_RANGE_CHECK
 	if (idx >= amountOfIndexes) {
@@ -132,6 +366,579 @@ int EEPROMWearLevel::getCurrentIndexEEPROM(const int idx, int dataLength) {
 	return eepromConfig[idx].lastIndexRead + 1 - dataLength;
 }
 
+void EEPROMWearLevel::putSample(const int idx, SeriesEncoder &encoder, const int32_t value) {
+#ifndef NO_RANGE_CHECK
+	if (idx >= amountOfIndexes) {
+		logOutOfRange(idx);
+		return;
+	}
+#endif
+	eepromConfig[idx].series = true;
+	byte buffer[SERIES_MAX_RECORD_LENGTH];
+	int length = encoder.encode(value, buffer);
+	int newStartIndex = getStartIndexEEPROM(idx);
+	if (eepromConfig[idx].lastIndexRead != NO_DATA) {
+		newStartIndex = eepromConfig[idx].lastIndexRead + 1;
+	}
+	const int endIndex = eepromConfig[idx + 1].startIndexControlBytes;
+	if (newStartIndex + length > endIndex) {
+		// fill the rest with 0x80 what never completes a value so that getSamples()
+		// does not decode older bytes after the last value of this rotation
+		const byte padding = 0x80;
+		for (int index = newStartIndex; index < endIndex; index++) {
+			writeBytes(index, &padding, 1);
+		}
+		// starts again at the beginning so it needs to be decodable on its own.
+		// The wrapped keyframe tells getSamples() that this rotation follows.
+		length = encoder.encodeKeyframe(value, buffer, true);
+	}
+	putBytes(idx, buffer, length, false);
+}
+
+int EEPROMWearLevel::getSamples(const int idx, int32_t values[], const int maxCount) {
+#ifndef NO_RANGE_CHECK
+	if (idx >= amountOfIndexes) {
+		logOutOfRange(idx);
+		return 0;
+	}
+#endif
+	const int startIndex = getStartIndexEEPROM(idx);
+	const int lastIndex = eepromConfig[idx].lastIndexRead;
+	if (lastIndex == NO_DATA) {
+		return 0;
+	}
+	// a wrapped keyframe at the beginning means that the previous rotation
+	// follows after the current data. Its values are older so they come first.
+	const bool wrapped = readByte(startIndex) == 0x80 && readByte(startIndex + 1) == 0x80
+	                     && readByte(startIndex + 2) == 0x00;
+	const int endIndex = eepromConfig[idx + 1].startIndexControlBytes - 1;
+	// count first to skip the oldest ones if there are more than maxCount
+	int skip = 0;
+	int count = 0;
+	if (wrapped) {
+		count = decodeSamples(lastIndex + 1, endIndex, NULL, count, skip);
+	}
+	count = decodeSamples(startIndex, lastIndex, NULL, count, skip);
+	skip = count - maxCount;
+	count = 0;
+	if (wrapped) {
+		count = decodeSamples(lastIndex + 1, endIndex, values, count, skip);
+	}
+	return decodeSamples(startIndex, lastIndex, values, count, skip);
+}
+
+int EEPROMWearLevel::decodeSamples(const int fromIndex, const int toIndex, int32_t values[], int count, int &skip) {
+	// starts with a new decoder so it only decodes values after a keyframe
+	SeriesDecoder decoder;
+	int32_t value;
+	for (int index = fromIndex; index <= toIndex; index++) {
+		if (decoder.decode(readByte(index), value)) {
+			if (values == NULL) {
+				count++;
+			} else if (skip > 0) {
+				skip--;
+			} else {
+				values[count] = value;
+				count++;
+			}
+		}
+	}
+	return count;
+}
+
+void EEPROMWearLevel::beginKeyValue(const int idx, const int maxKeys) {
+#ifndef NO_RANGE_CHECK
+	// +1 because the store uses idx and idx + 1
+	if (idx + 1 >= amountOfIndexes) {
+		logOutOfRange(idx + 1);
+		return;
+	}
+#endif
+	keyValueIdx = idx;
+	// a power of two with at least a third of the entries free keeps the probe sequences short
+	keyValueTableSize = 1;
+	while (keyValueTableSize <= maxKeys + maxKeys / 2) {
+		keyValueTableSize <<= 1;
+	}
+	delete[] keyValueEntries;
+	keyValueEntries = new KeyValueEntry[keyValueTableSize];
+	keyValueMaxKeys = maxKeys;
+	keyValueCompacting = false;
+
+	// the region with the newer commit record is the current one. The other one
+	// is either older or a compaction into it was interrupted.
+	byte generations[2] = {0, 0};
+	const bool committed0 = readKeyValueRegion(idx, generations[0], false);
+	const bool committed1 = readKeyValueRegion(idx + 1, generations[1], false);
+	keyValueRegion = 0;
+	if (committed0 && committed1) {
+		// signed difference so that the generation can overflow
+		keyValueRegion = (int8_t) (generations[1] - generations[0]) > 0 ? 1 : 0;
+	} else if (committed1) {
+		keyValueRegion = 1;
+	}
+	keyValueGeneration = generations[keyValueRegion];
+	if (!committed0 && !committed1) {
+#ifdef DEBUG_LOG
+		Serial.println(F("new key-value store"));
+#endif
+		EEPROMConfig &config = eepromConfig[idx];
+		clearBytesToOnes(config.startIndexControlBytes, getControlBytesCount(idx));
+		config.lastIndexRead = NO_DATA;
+		const byte commit[KEY_VALUE_HEADER_LENGTH] = {0, 0, 0, 1};
+		appendRecord(idx, commit, &keyValueGeneration, 1);
+	}
+	readKeyValueRegion(idx + keyValueRegion, keyValueGeneration, true);
+}
+
+bool EEPROMWearLevel::readKeyValueRegion(const int idx, byte &generation, const bool buildIndex) {
+	if (buildIndex) {
+		for (int entryIndex = 0; entryIndex < keyValueTableSize; entryIndex++) {
+			keyValueEntries[entryIndex].startIndex = NO_DATA;
+		}
+		keyValueKeyCount = 0;
+	}
+	bool committed = false;
+	const int lastIndex = eepromConfig[idx].lastIndexRead;
+	int index = getStartIndexEEPROM(idx);
+	while (lastIndex != NO_DATA && index + KEY_VALUE_HEADER_LENGTH - 1 <= lastIndex) {
+		const uint16_t keyHash = readByte(index) | (readByte(index + 1) << 8);
+		const byte keyCheck = readByte(index + KEY_VALUE_CHECK_OFFSET);
+		const int recordLength = KEY_VALUE_HEADER_LENGTH + readByte(index + KEY_VALUE_LENGTH_OFFSET);
+		if (index + recordLength - 1 > lastIndex) {
+			// only part of the record is marked while the control bytes are cleared
+			break;
+		}
+		if (keyHash == 0 && keyCheck == 0) {
+			committed = true;
+			generation = readByte(index + KEY_VALUE_HEADER_LENGTH);
+		} else if (buildIndex) {
+			KeyValueEntry &entry = keyValueEntries[findKeyEntry(keyHash, keyCheck)];
+			if (entry.startIndex == NO_DATA && keyValueKeyCount >= keyValueMaxKeys) {
+#ifdef DEBUG_LOG
+				Serial.println(F("too many keys"));
+#endif
+			} else {
+				if (entry.startIndex == NO_DATA) {
+					keyValueKeyCount++;
+					entry.keyHash = keyHash;
+					entry.keyCheck = keyCheck;
+				}
+				entry.startIndex = index;
+			}
+		}
+		index += recordLength;
+	}
+	return committed;
+}
+
+void EEPROMWearLevel::getKeyImpl(const char *key, byte *values, const int length) {
+	if (keyValueIdx == NO_KEY_VALUE) {
+#ifdef DEBUG_LOG
+		Serial.println(F("beginKeyValue() not called"));
+#endif
+		return;
+	}
+	uint16_t keyHash;
+	byte keyCheck;
+	hashKey(key, keyHash, keyCheck);
+	const int startIndex = keyValueEntries[findKeyEntry(keyHash, keyCheck)].startIndex;
+	if (startIndex == NO_DATA) {
+#ifdef DEBUG_LOG
+		Serial.println(F("no data"));
+#endif
+		return;
+	}
+	if (readByte(startIndex + KEY_VALUE_LENGTH_OFFSET) != length) {
+#ifdef DEBUG_LOG
+		Serial.println(F("stored length differs"));
+#endif
+		return;
+	}
+	for (int i = 0; i < length; i++) {
+		values[i] = readByte(startIndex + KEY_VALUE_HEADER_LENGTH + i);
+	}
+}
+
+void EEPROMWearLevel::putKeyImpl(const char *key, const byte *values, const int length) {
+	if (keyValueIdx == NO_KEY_VALUE || length > 0xFF) {
+#ifdef DEBUG_LOG
+		Serial.println(F("beginKeyValue() not called or value too long"));
+#endif
+		return;
+	}
+	uint16_t keyHash;
+	byte keyCheck;
+	hashKey(key, keyHash, keyCheck);
+	const int previousStartIndex = keyValueEntries[findKeyEntry(keyHash, keyCheck)].startIndex;
+	if (previousStartIndex != NO_DATA) {
+		boolean equal = readByte(previousStartIndex + KEY_VALUE_LENGTH_OFFSET) == length;
+		for (int i = 0; equal && i < length; i++) {
+			equal = readByte(previousStartIndex + KEY_VALUE_HEADER_LENGTH + i) == values[i];
+		}
+		if (equal) {
+#ifdef DEBUG_LOG
+			Serial.println(F("value is equal, do not write it"));
+#endif
+			return;
+		}
+	} else if (keyValueKeyCount >= keyValueMaxKeys) {
+#ifdef DEBUG_LOG
+		Serial.println(F("too many keys"));
+#endif
+		return;
+	}
+
+	const byte header[KEY_VALUE_HEADER_LENGTH] = {
+		(byte) (keyHash & 0xFF), (byte) (keyHash >> 8), keyCheck, (byte) length
+	};
+	const int startIndex = appendRecord(keyValueIdx + keyValueRegion, header, values, length);
+	if (startIndex == ERROR_CODE) {
+		int neededLength = getKeyValueLiveLength() + KEY_VALUE_HEADER_LENGTH + length;
+		if (previousStartIndex != NO_DATA) {
+			neededLength -= KEY_VALUE_HEADER_LENGTH + readByte(previousStartIndex + KEY_VALUE_LENGTH_OFFSET);
+		}
+		// the region is full so compact it now together with the new value. A second attempt
+		// starts over in case an interrupted compaction filled the other region with old values.
+		if (neededLength > getMaxDataLength(keyValueIdx + (keyValueRegion ^ 1))
+		        || (!compactKeyValues(micros(), KEY_VALUE_NO_BUDGET, header, values, length)
+		            && !compactKeyValues(micros(), KEY_VALUE_NO_BUDGET, header, values, length))) {
+#ifdef DEBUG_LOG
+			Serial.println(F("key-value store full"));
+#endif
+		}
+		// the compaction built the hash table again with the new value
+		return;
+	}
+
+	// the hash table might be rebuilt by the compaction so find the entry again
+	KeyValueEntry &entry = keyValueEntries[findKeyEntry(keyHash, keyCheck)];
+	if (entry.startIndex == NO_DATA) {
+		keyValueKeyCount++;
+		entry.keyHash = keyHash;
+		entry.keyCheck = keyCheck;
+	}
+	entry.startIndex = startIndex;
+	// copied again if a compaction is in progress
+	entry.copied = false;
+}
+
+void EEPROMWearLevel::hashKey(const char *key, uint16_t &keyHash, byte &keyCheck) const {
+	// FNV-1a folded to 16 bits
+	uint32_t hash = 2166136261UL;
+	int length = 0;
+	while (key[length] != 0) {
+		hash ^= (byte) key[length];
+		hash *= 16777619UL;
+		length++;
+	}
+	keyHash = (hash >> 16) ^ (hash & 0xFFFF);
+	// the CRC-8 is independent of the hash so two keys with the same hash
+	// most likely have a different check
+	keyCheck = checksum((const byte*) key, length);
+	if (keyHash == 0 && keyCheck == 0) {
+		// reserved for the commit record
+		keyCheck = 1;
+	}
+}
+
+int EEPROMWearLevel::findKeyEntry(const uint16_t keyHash, const byte keyCheck) const {
+	// open addressing with linear probing. The table is never full so
+	// there is always an empty entry that ends the search. Keys with the
+	// same hash but a different check get their own entries.
+	const int mask = keyValueTableSize - 1;
+	int entryIndex = keyHash & mask;
+	while (keyValueEntries[entryIndex].startIndex != NO_DATA
+	        && (keyValueEntries[entryIndex].keyHash != keyHash
+	            || keyValueEntries[entryIndex].keyCheck != keyCheck)) {
+		entryIndex = (entryIndex + 1) & mask;
+	}
+	return entryIndex;
+}
+
+bool EEPROMWearLevel::isKeyValueCompactionDue() {
+	if (keyValueCompacting) {
+		return true;
+	}
+	const int idx = keyValueIdx + keyValueRegion;
+	const int maxDataLength = getMaxDataLength(idx);
+	// +1 because lastIndexRead is the last index of the current record
+	const int usedLength = eepromConfig[idx].lastIndexRead + 1 - getStartIndexEEPROM(idx);
+	const int liveLength = getKeyValueLiveLength();
+	// compact when less than a quarter is free and compacting frees at least another quarter
+	return (maxDataLength - usedLength) * 4 < maxDataLength
+	       && (usedLength - liveLength) * 4 >= maxDataLength
+	       && liveLength <= getMaxDataLength(keyValueIdx + (keyValueRegion ^ 1));
+}
+
+int EEPROMWearLevel::getKeyValueLiveLength() {
+	// +1 for the generation of the commit record
+	int liveLength = KEY_VALUE_HEADER_LENGTH + 1;
+	for (int entryIndex = 0; entryIndex < keyValueTableSize; entryIndex++) {
+		const int startIndex = keyValueEntries[entryIndex].startIndex;
+		if (startIndex != NO_DATA) {
+			liveLength += KEY_VALUE_HEADER_LENGTH + readByte(startIndex + KEY_VALUE_LENGTH_OFFSET);
+		}
+	}
+	return liveLength;
+}
+
+int EEPROMWearLevel::getAppendIndex(const int idx, const int recordLength) {
+	const EEPROMConfig &config = eepromConfig[idx];
+	int startIndex = getStartIndexEEPROM(idx);
+	if (config.lastIndexRead != NO_DATA) {
+		startIndex = config.lastIndexRead + 1;
+	}
+	if (startIndex + recordLength > eepromConfig[idx + 1].startIndexControlBytes) {
+		return ERROR_CODE;
+	}
+	return startIndex;
+}
+
+int EEPROMWearLevel::appendRecord(const int idx, const byte *header, const byte *values, const int length) {
+	const int recordLength = KEY_VALUE_HEADER_LENGTH + length;
+	const int startIndex = getAppendIndex(idx, recordLength);
+	if (startIndex == ERROR_CODE) {
+		return ERROR_CODE;
+	}
+	writeBytes(startIndex, header, KEY_VALUE_HEADER_LENGTH);
+	writeBytes(startIndex + KEY_VALUE_HEADER_LENGTH, values, length);
+	updateControlBytes(idx, startIndex, recordLength, getControlBytesCount(idx));
+	return startIndex;
+}
+
+int EEPROMWearLevel::writeRecord(const int idx, const int fromIndex, const byte *header, const byte *values,
+                                 const int length, const unsigned long startMicros, const unsigned long budgetMicros) {
+	int recordLength = KEY_VALUE_HEADER_LENGTH + length;
+	if (header == NULL) {
+		recordLength = KEY_VALUE_HEADER_LENGTH + readByte(fromIndex + KEY_VALUE_LENGTH_OFFSET);
+	}
+	const int startIndex = getAppendIndex(idx, recordLength);
+	if (startIndex == ERROR_CODE) {
+		return ERROR_CODE;
+	}
+	if (fromIndex != keyValueWrittenFromIndex) {
+		// the bytes written before belong to another record
+		keyValueWrittenFromIndex = fromIndex;
+		keyValueWrittenLength = 0;
+	}
+	// the bytes are not marked as used yet so a power loss or another record
+	// written to the same place later does no harm
+	for (; keyValueWrittenLength < recordLength; keyValueWrittenLength++) {
+		// the byte might need an erase and a write
+		if (micros() - startMicros + 2UL * EEPROM_ERASE_MICROS > budgetMicros) {
+			return NO_DATA;
+		}
+		byte value;
+		if (header == NULL) {
+			value = readByte(fromIndex + keyValueWrittenLength);
+		} else if (keyValueWrittenLength < KEY_VALUE_HEADER_LENGTH) {
+			value = header[keyValueWrittenLength];
+		} else {
+			value = values[keyValueWrittenLength - KEY_VALUE_HEADER_LENGTH];
+		}
+		writeBytes(startIndex + keyValueWrittenLength, &value, 1);
+	}
+	if (micros() - startMicros + getMarkMicros(recordLength) > budgetMicros) {
+		return NO_DATA;
+	}
+	updateControlBytes(idx, startIndex, recordLength, getControlBytesCount(idx));
+	keyValueWrittenLength = 0;
+	return startIndex;
+}
+
+unsigned long EEPROMWearLevel::getMarkMicros(const int dataLength) const {
+	// a program of every control byte of the data, which can be one more than
+	// dataLength / 8 if it is not aligned, and of the single bit of the last data byte
+	return ((dataLength + 6) / 8 + 2) * (unsigned long) EEPROM_ERASE_MICROS;
+}
+
+bool EEPROMWearLevel::compactKeyValues(const unsigned long startMicros, const unsigned long budgetMicros,
+                                       const byte *header, const byte *values, const int length) {
+	// the current region stays valid until the commit record of the other region
+	// is written so that a power loss at any point keeps all values
+	const int targetIdx = keyValueIdx + (keyValueRegion ^ 1);
+	EEPROMConfig &config = eepromConfig[targetIdx];
+	if (!keyValueCompacting) {
+#ifdef DEBUG_LOG
+		Serial.println(F("compact key-value store"));
+#endif
+		countRotation(targetIdx);
+		for (int entryIndex = 0; entryIndex < keyValueTableSize; entryIndex++) {
+			keyValueEntries[entryIndex].copied = false;
+		}
+		keyValueClearedControlBytes = 0;
+		keyValueWrittenLength = 0;
+		keyValueCompacting = true;
+	}
+	// Clear the control bytes from front to back, one per budget check. Until the last
+	// one is cleared, the other region still has all its previous records or none.
+	const int controlBytesCount = getControlBytesCount(targetIdx);
+	while (keyValueClearedControlBytes < controlBytesCount) {
+		const int index = config.startIndexControlBytes + keyValueClearedControlBytes;
+		if (readByte(index) != 0xFF) {
+			if (micros() - startMicros + EEPROM_ERASE_MICROS > budgetMicros) {
+				return false;
+			}
+			clearBytesToOnes(index, 1);
+		}
+		keyValueClearedControlBytes++;
+		if (keyValueClearedControlBytes == controlBytesCount) {
+			config.lastIndexRead = NO_DATA;
+		}
+	}
+	for (int entryIndex = 0; entryIndex < keyValueTableSize; entryIndex++) {
+		KeyValueEntry &entry = keyValueEntries[entryIndex];
+		if (entry.startIndex == NO_DATA || entry.copied
+		        || (header != NULL && entry.keyHash == (header[0] | (header[1] << 8))
+		            && entry.keyCheck == header[KEY_VALUE_CHECK_OFFSET])) {
+			// the new value of header replaces the latest record of this key
+			continue;
+		}
+		const int startIndex = writeRecord(targetIdx, entry.startIndex, NULL, NULL, 0, startMicros, budgetMicros);
+		if (startIndex == NO_DATA) {
+			return false;
+		}
+		if (startIndex == ERROR_CODE) {
+			// values updated during the compaction were copied again until it was full
+			keyValueCompacting = false;
+			return false;
+		}
+		entry.copied = true;
+	}
+
+	const byte commit[KEY_VALUE_HEADER_LENGTH] = {0, 0, 0, 1};
+	const byte generation = keyValueGeneration + 1;
+	if (header != NULL) {
+		// putKey() does not stop in the middle so start the new record from the beginning
+		keyValueWrittenLength = 0;
+		if (writeRecord(targetIdx, NO_DATA, header, values, length, startMicros, budgetMicros) == ERROR_CODE) {
+			keyValueCompacting = false;
+			return false;
+		}
+	}
+	const int startIndex = writeRecord(targetIdx, NO_DATA, commit, &generation, 1, startMicros, budgetMicros);
+	if (startIndex == NO_DATA) {
+		return false;
+	}
+	keyValueCompacting = false;
+	if (startIndex == ERROR_CODE) {
+		return false;
+	}
+	keyValueRegion ^= 1;
+	readKeyValueRegion(targetIdx, keyValueGeneration, true);
+	return true;
+}
+
+bool EEPROMWearLevel::maintain(const unsigned long budgetMicros) {
+	const unsigned long startMicros = micros();
+	// an unfinished stage continues on the next call and does not hold back the others
+	bool done = repairCopies(startMicros, budgetMicros);
+	if (keyValueIdx != NO_KEY_VALUE && isKeyValueCompactionDue()
+	        && !compactKeyValues(startMicros, budgetMicros)) {
+		done = false;
+	}
+	for (int idx = 0; idx < amountOfIndexes; idx++) {
+		const EEPROMConfig &config = eepromConfig[idx];
+		const int dataLength = config.lastDataLength;
+		if (dataLength == 0) {
+			// nothing written yet so the length of the next write is not known
+			continue;
+		}
+		if ((keyValueCompacting && idx == keyValueIdx + (keyValueRegion ^ 1)) || isRepairInProgress(idx)) {
+			// the compaction or the repair writes the next bytes there
+			continue;
+		}
+		int nextStartIndex = config.lastIndexRead + 1;
+		if (config.lastIndexRead == NO_DATA) {
+			// the other key-value region after an unfinished compaction
+			nextStartIndex = getStartIndexEEPROM(idx);
+		} else if (nextStartIndex + dataLength > eepromConfig[idx + 1].startIndexControlBytes) {
+			// the next write starts again at the beginning
+			nextStartIndex = getStartIndexEEPROM(idx);
+			if (keyValueIdx != NO_KEY_VALUE && (idx == keyValueIdx || idx == keyValueIdx + 1)) {
+				// the key-value store moves its values to the other region instead
+				continue;
+			}
+			if (config.series) {
+				// the wrapped keyframe at the beginning links to the previous rotation
+				continue;
+			}
+			if (nextStartIndex + dataLength > config.lastIndexRead - (dataLength - 1)) {
+				// do not erase the current data
+				continue;
+			}
+		}
+		for (int index = nextStartIndex; index < nextStartIndex + dataLength; index++) {
+			if (readByte(index) != 0xFF) {
+				if (micros() - startMicros + EEPROM_ERASE_MICROS > budgetMicros) {
+					return false;
+				}
+				clearBytesToOnes(index, 1);
+			}
+		}
+	}
+	return done;
+}
+
+EEPROMWearLevel::WearInfo EEPROMWearLevel::getWearInfo(const int idx, const unsigned long endurance) {
+	WearInfo info;
+	info.rotations = 0;
+	info.remainingCycles = 0;
+	info.currentRotationPercent = 0;
+#ifndef NO_RANGE_CHECK
+	if (idx >= amountOfIndexes) {
+		logOutOfRange(idx);
+		return info;
+	}
+#endif
+	const EEPROMConfig &config = eepromConfig[idx];
+	info.rotations = config.rotations;
+	if (info.rotations < endurance) {
+		info.remainingCycles = endurance - info.rotations;
+	}
+	if (config.lastIndexRead != NO_DATA) {
+		// +1 because lastIndexRead is the last index of the current element
+		const long usedLength = config.lastIndexRead + 1 - getStartIndexEEPROM(idx);
+		info.currentRotationPercent = usedLength * 100 / getMaxDataLength(idx);
+	}
+	return info;
+}
+
+void EEPROMWearLevel::persistRotations(const int idx, const int counterIdx) {
+#ifndef NO_RANGE_CHECK
+	// idx cannot count its own rotations
+	if (idx >= amountOfIndexes || counterIdx >= amountOfIndexes || counterIdx == idx) {
+		logOutOfRange(max(idx, counterIdx));
+		return;
+	}
+#endif
+	EEPROMConfig &config = eepromConfig[idx];
+	if (config.rotationCounterIdx != NO_ROTATION_COUNTER) {
+		// already read, adding the persisted value again would count it twice
+#ifdef DEBUG_LOG
+		Serial.println(F("rotations already persisted"));
+#endif
+		return;
+	}
+	config.rotationCounterIdx = counterIdx;
+	unsigned long persistedRotations = 0;
+	getBytes(counterIdx, (byte*) &persistedRotations, sizeof(persistedRotations));
+	// keep the rotations counted since begin()
+	config.rotations += persistedRotations;
+	if (config.rotations != persistedRotations) {
+		putBytes(counterIdx, (const byte*) &config.rotations, sizeof(config.rotations), true);
+	}
+}
+
+void EEPROMWearLevel::countRotation(const int idx) {
+	EEPROMConfig &config = eepromConfig[idx];
+	config.rotations++;
+	if (config.rotationCounterIdx != NO_ROTATION_COUNTER) {
+		putBytes(config.rotationCounterIdx, (const byte*) &config.rotations, sizeof(config.rotations), false);
+	}
+}
+
 int EEPROMWearLevel::getWriteStartIndex(const int idx, const int dataLength, const byte *values, const bool update, const int controlBytesCount) {
 	if (dataLength > getMaxDataLength(idx)) {
 #ifdef DEBUG_LOG
@@ -177,39 +984,83 @@ int EEPROMWearLevel::getWriteStartIndex(const int idx, const int dataLength, con
 #ifdef DEBUG_LOG
 		Serial.println(F("all used, start again"));
 #endif
-		clearBytesToOnes(config.startIndexControlBytes, controlBytesCount);
-		newStartIndex = config.startIndexControlBytes + controlBytesCount;
+		countRotation(idx);
+		const int startIndexData = config.startIndexControlBytes + controlBytesCount;
+		newStartIndex = startIndexData;
+		// The control bytes are only cleared in updateControlBytes() after the new data is
+		// written if the new data does not overwrite the previous one and the last bytes
+		// of both are marked in different control bytes. Otherwise the control byte of the
+		// previous value must be erased before the new value can be marked, so they are
+		// cleared now and a power loss until the new data is written loses the previous value.
+		// -1 because it is the last index
+		if (newStartIndex + dataLength - 1 >= previousLastIndex - (dataLength - 1)
+		        || (dataLength - 1) / 8 >= (previousLastIndex - startIndexData) / 8) {
+			clearBytesToOnes(config.startIndexControlBytes, controlBytesCount);
+			config.lastIndexRead = NO_DATA;
+		}
 	}
 	return newStartIndex;
 }
 
 void EEPROMWearLevel::updateControlBytes(int idx, int newStartIndex, int dataLength, const int controlBytesCount) {
 	EEPROMConfig &config = eepromConfig[idx];
+	// started again at the beginning without clearing the control bytes yet
+	const bool wrapAround = config.lastIndexRead != NO_DATA && newStartIndex <= config.lastIndexRead;
 	// -1 because it is the last index
 	config.lastIndexRead = newStartIndex + dataLength - 1;
+	config.lastDataLength = dataLength;
 	const int startIndexData = config.startIndexControlBytes + controlBytesCount;
 	const int startIndexRelative = newStartIndex - startIndexData;
-	int controlByteIndex = startIndexRelative / 8;
-	byte newBitPosInControlByte = startIndexRelative - controlByteIndex * 8;
+	// -1 because it is the last index
+	const int endIndexRelative = startIndexRelative + dataLength - 1;
+	const int firstControlByteIndex = startIndexRelative / 8;
 
-	// unset
-	byte writeMask = 0xFF;
-	for (int i = 0; i < dataLength; i++) {
-		writeMask  &= ~(1 << (7 - newBitPosInControlByte));
-		newBitPosInControlByte++;
-		if (newBitPosInControlByte > 7) {
-			// write and go to next byte
-			programZeroBitsToZero(config.startIndexControlBytes + controlByteIndex, writeMask, 2);
-			writeMask = 0xFF;
-			newBitPosInControlByte = 0;
-			controlByteIndex++;
+	if (wrapAround) {
+		// clear only the control bytes used for the new data. The previous position
+		// stays in the last control byte that is not 0xFF.
+		clearBytesToOnes(config.startIndexControlBytes, endIndexRelative / 8 + 1);
+	}
+	// Program the bit of the last data byte first and alone. findIndex() uses the last
+	// zero bit of the last control byte that is not 0xFF so the new position is valid as
+	// soon as this bit is programmed. A byte program cut off by a power loss can leave
+	// any of its bits programmed, so programming it together with the other bits could
+	// leave the index in the middle of the new data.
+	programBitToZero(config.startIndexControlBytes + endIndexRelative / 8, endIndexRelative % 8);
+	// then the other bits of its control byte and the control bytes before
+	for (int controlByteIndex = endIndexRelative / 8; controlByteIndex >= firstControlByteIndex; controlByteIndex--) {
+		programZeroBitsToZero(config.startIndexControlBytes + controlByteIndex,
+		                      getControlByteWriteMask(controlByteIndex, startIndexRelative, endIndexRelative));
+	}
+	// verify all once at the end and try again if not programmed as expected
+	for (int controlByteIndex = endIndexRelative / 8; controlByteIndex >= firstControlByteIndex; controlByteIndex--) {
+		const int index = config.startIndexControlBytes + controlByteIndex;
+		const byte writeMask = getControlByteWriteMask(controlByteIndex, startIndexRelative, endIndexRelative);
+		// writeMask ^ 0xFF inverts all bits of writeMask
+		if ((readByte(index) & (writeMask ^ 0xFF)) != 0) {
+#ifdef DEBUG_LOG
+			Serial.print(F("program control byte again: "));
+			Serial.println(index);
+#endif
+			programZeroBitsToZero(index, writeMask);
 		}
 	}
-	if (writeMask != 0xFF) {
-		programZeroBitsToZero(config.startIndexControlBytes + controlByteIndex, writeMask, 2);
+	if (wrapAround) {
+		// clear the rest from front to back so that the previous position is cleared last
+		const int firstUnusedControlByteIndex = endIndexRelative / 8 + 1;
+		clearBytesToOnes(config.startIndexControlBytes + firstUnusedControlByteIndex,
+		                 controlBytesCount - firstUnusedControlByteIndex);
 	}
 }
 
+byte EEPROMWearLevel::getControlByteWriteMask(const int controlByteIndex, const int startIndexRelative, const int endIndexRelative) const {
+	// the bit positions of this control byte that are inside of the data
+	const int firstBitPos = max(startIndexRelative - controlByteIndex * 8, 0);
+	const int lastBitPos = min(endIndexRelative - controlByteIndex * 8, 7);
+	// bit position 0 is the highest bit
+	const byte usedBits = (0xFF >> firstBitPos) & (0xFF << (7 - lastBitPos));
+	return usedBits ^ 0xFF;
+}
+
 void EEPROMWearLevel::printStatus(Print &print) {
 	print.println(F("EEPROMWearLevel status: "));
 	for (int index = 0; index < amountOfIndexes; index++) {
@@ -300,62 +1151,19 @@ int EEPROMWearLevel::findIndex(const EEPROMConfig &config, const int controlByte
 
 /**
    returns the index of the control byte that contains the bit which
-   points to the next write position.
-   The index is inside of control bytes even if all used.
-   Does a binary search to find the index.
+   points to the current position. That is the last control byte that
+   is not 0xFF or the first one if all are 0xFF.
+   Searches from the end because control bytes before the current one
+   can temporarily be 0xFF while updateControlBytes() starts again at the
+   beginning.
  */
 int EEPROMWearLevel::findControlByteIndex(const int startIndex, const int length) {
-	const int endIndex = startIndex + length - 1;
-	int lowerBound = startIndex;
-	int upperBound = endIndex;
-	int midPoint = -1;
-
-	byte currentByte = 0xFF;
-	while (lowerBound <= upperBound) {
-		// compute the mid point
-		midPoint = lowerBound + (upperBound - lowerBound) / 2;
-
-		currentByte = readByte(midPoint);
-		if (currentByte != 0 && currentByte != 0xFF) {
-			// searched control byte found because it is neigher 0 nor 0xFF what means
-			// that some of its bits are in use, some not
-			return midPoint;
-		} else {
-			if (currentByte == 0) {
-				// searched control byte is in upper half
-				lowerBound = midPoint + 1;
-			} else {
-				// searched control byte is in lower half
-				upperBound = midPoint - 1;
-			}
-		}
-	}
-
-	if (currentByte == 0) {
-		// searched control byte is above
-		int controlByteIndex = midPoint;
-		while (currentByte == 0 && controlByteIndex < endIndex) {
-			controlByteIndex++;
-			currentByte = readByte(controlByteIndex);
-		}
-		return controlByteIndex;
-	} else {
-		// currentByte == 0xff so searched control byte is below
-		int controlByteIndex = midPoint;
-		while (currentByte == 0xFF && controlByteIndex >= startIndex) {
-			controlByteIndex--;
-			currentByte = readByte(controlByteIndex);
-		}
-		// we want the byte where all bits are still set
-		// except when it is the last one.
-		if (controlByteIndex >= endIndex) {
-			// do not go to next because it is the last one
+	for (int controlByteIndex = startIndex + length - 1; controlByteIndex > startIndex; controlByteIndex--) {
+		if (readByte(controlByteIndex) != 0xFF) {
 			return controlByteIndex;
-		} else {
-			// go to next as current control byte is 0
-			return controlByteIndex + 1;
 		}
 	}
+	return startIndex;
 }
 
 inline byte EEPROMWearLevel::readByte(const int index) {
@@ -366,6 +1174,25 @@ inline byte EEPROMWearLevel::readByte(const int index) {
 #endif
 }
 
+void EEPROMWearLevel::writeBytes(const int startIndex, const byte *values, const int length) {
+	for (int i = 0; i < length; i++) {
+		const int index = startIndex + i;
+		const byte currentValue = readByte(index);
+		if (currentValue == values[i]) {
+			continue;
+		}
+		if ((currentValue & values[i]) == values[i]) {
+			// only bits from 1 to 0, no erase needed what takes about half the time
+			programZeroBitsToZero(index, values[i]);
+		} else {
+#ifndef NO_EEPROM_WRITES
+			EEPROMClass::write(index, values[i]);
+#else
+			fakeWriteByte(index, values[i]);
+#endif
+		}
+	}
+}
 
 // http://www.tronix.io/data/avratmega/eeprom/
 void EEPROMWearLevel::programBitToZero(int index, byte bitIndex) {
@@ -374,40 +1201,65 @@ void EEPROMWearLevel::programBitToZero(int index, byte bitIndex) {
 	programZeroBitsToZero(index, value);
 }
 
-void EEPROMWearLevel::programZeroBitsToZero(int index, byte byteWithZeros, int retryCount) {
-	do {
-#ifdef DEBUG_LOG
-		Serial.print(F("programZeroBitsToZero: , index: "));
-		Serial.print(index);
-		Serial.print(F(", byteWithZeros: "));
-		printBinWithLeadingZeros(byteWithZeros);
-		Serial.println();
-#endif
-		programZeroBitsToZero(index, byteWithZeros);
-		retryCount--;
-#ifdef DEBUG_LOG
-		Serial.print(F("EEPROM is: "));
-		printBinWithLeadingZeros(readByte(index));
-		Serial.println();
-#endif
-		// byteWithZeros ^ 0xFF inverts all bits of byteWithZeros
-	} while (retryCount > 0 && (readByte(index) & (byteWithZeros ^ 0xFF)) != 0);
-}
-
 #ifdef NO_EEPROM_WRITES
 // emulate EEPROM behaviour to program only bits that are 0
 void EEPROMWearLevel::programZeroBitsToZero(int index, byte byteWithZeros) {
-	byte mask = 1;
-	int bitPosInByte = 7;
-	// do while bit still in mask
-	while (mask != 0) {
-		if ((byteWithZeros & mask) == 0) {
-			fakeEeprom[index] &= ~(1 << (7 - bitPosInByte));
+	fakeProgramCount++;
+	// every bit that changes is a separate operation so that the power loss simulation
+	// can stop in the middle of a byte. The highest bit first because the real EEPROM
+	// does not guarantee any order and the highest bit stands for the first data byte
+	// what is the worst case for the control bytes.
+	for (byte mask = 0x80; mask != 0; mask >>= 1) {
+		if ((byteWithZeros & mask) == 0 && (fakeEeprom[index] & mask) != 0 && fakeOperation()) {
+			fakeEeprom[index] &= ~mask;
 		}
-		mask <<= 1;
-		bitPosInByte--;
 	}
 }
+
+void EEPROMWearLevel::simulatePowerLossAfter(const long operations) {
+	fakeOperationsUntilPowerLoss = operations;
+}
+
+long EEPROMWearLevel::getOperationsUntilPowerLoss() const {
+	return fakeOperationsUntilPowerLoss;
+}
+
+bool EEPROMWearLevel::fakeOperation() {
+	if (fakeOperationsUntilPowerLoss == NO_POWER_LOSS) {
+		return true;
+	}
+	if (fakeOperationsUntilPowerLoss == 0) {
+		// power lost, ignore all further operations
+		return false;
+	}
+	fakeOperationsUntilPowerLoss--;
+	return true;
+}
+
+unsigned long EEPROMWearLevel::getEraseCount() const {
+	return fakeEraseCount;
+}
+
+unsigned long EEPROMWearLevel::getProgramCount() const {
+	return fakeProgramCount;
+}
+
+void EEPROMWearLevel::resetOperationCounts() {
+	fakeEraseCount = 0;
+	fakeProgramCount = 0;
+}
+
+void EEPROMWearLevel::fakeWriteByte(int index, byte value) {
+	if (fakeEeprom[index] == value) {
+		return;
+	}
+	// the real EEPROM first erases the byte and then programs it
+	fakeEraseCount++;
+	if (fakeOperation()) {
+		fakeEeprom[index] = 0xFF;
+	}
+	programZeroBitsToZero(index, value);
+}
 #endif
 
 void EEPROMWearLevel::clearBytesToOnes(int fromIndex, int length) {
@@ -416,7 +1268,10 @@ void EEPROMWearLevel::clearBytesToOnes(int fromIndex, int length) {
 #ifndef NO_EEPROM_WRITES
 			clearByteToOnes(i);
 #else
-			fakeEeprom[i] = 0xFF;
+			fakeEraseCount++;
+			if (fakeOperation()) {
+				fakeEeprom[i] = 0xFF;
+			}
 #endif
 #ifdef DEBUG_LOG
 			Serial.print(F("clear byte: "));
@@ -21,6 +21,7 @@
 #define EEPROM_WEAR_LEVEL_H
 
 #include <EEPROM.h>
+#include "EEPROMWearLevelSeriesCodec.h"
 
 /**
    uncomment to deactivate the range check of idx.
@@ -38,8 +39,10 @@
    the size of the fake eeprom if used
 */
 #ifdef NO_EEPROM_WRITES
+#ifndef FAKE_EEPROM_SIZE
 #define FAKE_EEPROM_SIZE 34
 #endif
+#endif
 
 /*
    the index of the layoutVersion byte
@@ -55,8 +58,64 @@
 */
 #define ERROR_CODE -2
 
+/**
+   the idx of the key-value store if beginKeyValue() was not called
+*/
+#define NO_KEY_VALUE -1
+
+/**
+   the rotation counter idx if persistRotations() was not called
+*/
+#define NO_ROTATION_COUNTER -1
+
+/**
+   passed to simulatePowerLossAfter() to deactivate the power loss simulation
+*/
+#define NO_POWER_LOSS -1
+
+/**
+   the rated amount of erase/write cycles of an EEPROM cell used by getWearInfo()
+*/
+#ifndef EEPROM_ENDURANCE
+#define EEPROM_ENDURANCE 100000
+#endif
+
+/**
+   the time in microseconds a single byte erase takes. It is used by maintain()
+   to stay within the given time budget.
+*/
+#ifndef EEPROM_ERASE_MICROS
+#define EEPROM_ERASE_MICROS 1800
+#endif
+
+/**
+   the amount of invalid copies of getRedundant() that can wait for the repair
+   in maintain(). Further invalid copies are found again on the next getRedundant().
+*/
+#ifndef REPAIR_QUEUE_LENGTH
+#define REPAIR_QUEUE_LENGTH 4
+#endif
+
 class EEPROMWearLevel: EEPROMClass {
   public:
+    class WearInfo {
+      public:
+        /**
+           the amount of completed rotations through the whole partition. Every byte
+           of the partition is erased at most once per rotation. Only the rotations
+           since begin() are counted unless persistRotations() is used.
+        */
+        unsigned long rotations;
+        /**
+           the estimated erase cycles left until the rated endurance is reached.
+        */
+        unsigned long remainingCycles;
+        /**
+           how much of the current rotation is used in percent.
+        */
+        byte currentRotationPercent;
+    };
+
     /**
         Initialises EEPROMWearLevel. One of the begin() methods must be called
         before any other method.
@@ -154,6 +213,113 @@ class EEPROMWearLevel: EEPROMClass {
     */
     int getCurrentIndexEEPROM(const int idx, int dataLength) ;
 
+    /**
+       writes invalid copies found by getRedundant() again, compacts the key-value store
+       when it is almost full and erases the data bytes the next write of every idx will
+       use so that put() can program them without erasing.
+       Call it from loop() when there is time left. The compaction continues on the next
+       call if the budget is too small, so putKey() only compacts if maintain() is not
+       called often enough. It copies one byte per budget check and does not hold back
+       the other work.
+       Only bytes of idx written since begin() are erased because the length of the
+       data is not known before. When used as ring buffer, the oldest entry is erased
+       one write earlier. For a compressed series, this applies to the oldest values
+       after the current position but not at the beginning of the partition.
+       @param budgetMicros the maximum time in microseconds to spend.
+       @return true if all is done, false if the budget was too small.
+    */
+    bool maintain(const unsigned long budgetMicros);
+
+    /**
+       returns the wear information of idx. It only uses values in RAM so it is
+       cheap to call.
+       @param endurance the rated erase/write cycles of an EEPROM cell.
+    */
+    WearInfo getWearInfo(const int idx, const unsigned long endurance = EEPROM_ENDURANCE);
+
+    /**
+       persists the amount of completed rotations of idx in counterIdx so that
+       getWearInfo() also counts the rotations before a restart. Call it after
+       begin() and on every start, further calls until the next begin() are ignored.
+       counterIdx is written every time idx starts again at the beginning. It needs
+       a partition of at least 9 bytes, must be another idx than idx and must not be
+       used for anything else.
+    */
+    void persistRotations(const int idx, const int counterIdx);
+
+    /**
+       reads the last written value of idx that was written with putRedundant().
+       Only the first copy is read as long as its checksum is valid. Invalid copies
+       are queued and written again with the first valid one by maintain().
+       Leaves t unchanged if no copy is valid.
+       @param idx the idx of the first copy.
+       @param copies the amount of copies, the same as passed to putRedundant().
+    */
+    template< typename T > T &getRedundant(const int idx, const int copies, T &t) {
+      return getRedundantImpl(idx, copies, t);
+    }
+
+    /**
+       writes a new value together with a checksum to the idx and the following
+       copies - 1 indexes if it is not the same as the last one. Use it for values that
+       need to survive the failure of EEPROM cells. The partitions need to be
+       1 byte longer than the value for the checksum.
+       @param idx the idx of the first copy.
+       @param copies the amount of copies, usually 2 or 3.
+    */
+    template< typename T > const T &putRedundant(const int idx, const int copies, const T &t) {
+      return putRedundantImpl(idx, copies, t);
+    }
+
+    /**
+       appends value to the compressed series stored in idx. Only the difference to the
+       previous value is stored, every keyframeInterval values and when starting again at
+       the beginning of the partition the value itself. The partition is used as ring buffer.
+       @param encoder the encoder of this series. It needs to be kept as long as values are
+       appended. After a restart, a new encoder can be used.
+    */
+    void putSample(const int idx, SeriesEncoder &encoder, const int32_t value);
+
+    /**
+       reads the values of the compressed series stored in idx, the oldest first. The
+       values before the current position are read from the first keyframe on. If there
+       are more than maxCount values, the latest maxCount values are read.
+       @return the amount of values read to values.
+    */
+    int getSamples(const int idx, int32_t values[], const int maxCount);
+
+    /**
+       Uses the partitions of idx and idx + 1 as key-value store. Call it after begin().
+       The values are appended to the current partition together with a hash of the key.
+       When it is full, the latest value of every key is copied to the other partition
+       what becomes the current one after all values are copied, so a power loss at any
+       point keeps all values. Both partitions should have the same length.
+       New keys can be added without changing the layoutVersion.
+       Do not use put() or get() on these idx.
+       @param idx the first idx to use as key-value store.
+       @param maxKeys the maximum amount of keys. Every key uses up to 18 bytes of RAM
+       for the hash table that finds the values.
+    */
+    void beginKeyValue(const int idx, const int maxKeys);
+
+    /**
+       reads the last written value of key or leaves t unchanged if no
+       value written yet. Requires beginKeyValue().
+    */
+    template< typename T > T &getKey(const char *key, T &t) {
+      getKeyImpl(key, (byte*) &t, sizeof(t));
+      return t;
+    }
+
+    /**
+       writes a new value of key if it is not the same as the last one.
+       Requires beginKeyValue(). Values can be up to 255 bytes long.
+    */
+    template< typename T > const T &putKey(const char *key, const T &t) {
+      putKeyImpl(key, (const byte*) &t, sizeof(t));
+      return t;
+    }
+
     /**
        prints the EEPROMWearLevel status to print. Use Serial to
        print to the default serial port.
@@ -165,6 +331,41 @@ class EEPROMWearLevel: EEPROMClass {
     */
     void printBinary(Print &print, int startIndex, int endIndex);
 
+#ifdef NO_EEPROM_WRITES
+    /**
+       simulates a power loss after the given amount of EEPROM operations. Every programmed
+       bit and every erased byte counts as one operation. After the power loss, all EEPROM
+       operations are ignored until this method is called again. Call begin() afterwards
+       to simulate the restart of the device. Pass NO_POWER_LOSS to deactivate it.
+       Only available with NO_EEPROM_WRITES.
+    */
+    void simulatePowerLossAfter(const long operations);
+
+    /**
+       returns the amount of operations left until the simulated power loss or
+       NO_POWER_LOSS if deactivated. If it is greater than 0 after a call, the call
+       was completed without power loss. Only available with NO_EEPROM_WRITES.
+    */
+    long getOperationsUntilPowerLoss() const;
+
+    /**
+       returns the amount of byte erases on the fake EEPROM since the last
+       resetOperationCounts(). Only available with NO_EEPROM_WRITES.
+    */
+    unsigned long getEraseCount() const;
+
+    /**
+       returns the amount of byte program operations on the fake EEPROM since
+       the last resetOperationCounts(). Only available with NO_EEPROM_WRITES.
+    */
+    unsigned long getProgramCount() const;
+
+    /**
+       sets the erase and program counts to 0. Only available with NO_EEPROM_WRITES.
+    */
+    void resetOperationCounts();
+#endif
+
     /**
        Constructor of the EEPROMWearLevel. Do not call this method as there
        is only one instance of EEPROMWearLevel supported.
@@ -185,13 +386,113 @@ class EEPROMWearLevel: EEPROMClass {
            NO_DATA (-1) for no data
         */
         int lastIndexRead;
+        /**
+           the length of the data written last since begin(). 0 if nothing
+           written yet.
+        */
+        int lastDataLength;
+        /**
+           the amount of completed rotations since begin() or the persisted
+           value if persistRotations() is used
+        */
+        unsigned long rotations;
+        /**
+           the idx to persist the rotations or NO_ROTATION_COUNTER
+        */
+        int rotationCounterIdx;
+        /**
+           true if putSample() wrote to this idx since begin()
+        */
+        bool series;
+    };
+
+    class RepairEntry {
+      public:
+        /**
+           the idx of the valid copy
+        */
+        int sourceIdx;
+        /**
+           the idx of the invalid copy
+        */
+        int targetIdx;
+        int dataLength;
+        /**
+           the first index the value is written to in targetIdx or NO_DATA if
+           the repair is not started yet
+        */
+        int writeStartIndex;
+        /**
+           the bytes already written to targetIdx
+        */
+        int writtenLength;
+    };
+
+    class KeyValueEntry {
+      public:
+        /**
+           the hash of the key
+        */
+        uint16_t keyHash;
+        /**
+           the check byte of the key
+        */
+        byte keyCheck;
+        /**
+           the first index of the latest record of this key or NO_DATA if
+           the entry is empty
+        */
+        int startIndex;
+        /**
+           true if the latest record is copied to the other region by the
+           compaction in progress
+        */
+        bool copied;
     };
 
     EEPROMConfig *eepromConfig;
 #ifdef NO_EEPROM_WRITES
     byte fakeEeprom[FAKE_EEPROM_SIZE];
+    long fakeOperationsUntilPowerLoss;
+    unsigned long fakeEraseCount;
+    unsigned long fakeProgramCount;
 #endif
     int amountOfIndexes;
+    RepairEntry repairQueue[REPAIR_QUEUE_LENGTH];
+    int repairQueueLength;
+    /**
+       the first of the two partitions of the key-value store
+    */
+    int keyValueIdx;
+    /**
+       0 or 1, the current region of the key-value store is keyValueIdx + keyValueRegion
+    */
+    byte keyValueRegion;
+    /**
+       the generation of the commit record in the current region
+    */
+    byte keyValueGeneration;
+    /**
+       true while the values are copied to the other region
+    */
+    bool keyValueCompacting;
+    /**
+       the control bytes of the other region cleared by the compaction in progress
+    */
+    int keyValueClearedControlBytes;
+    /**
+       the start index of the record that writeRecord() wrote last, NO_DATA if it
+       was not read from the EEPROM, and how many of its bytes are written
+    */
+    int keyValueWrittenFromIndex;
+    int keyValueWrittenLength;
+    /**
+       hash table of the stored keys with keyValueTableSize entries
+    */
+    KeyValueEntry *keyValueEntries;
+    int keyValueTableSize;
+    int keyValueMaxKeys;
+    int keyValueKeyCount;
 
     void init(const byte layoutVersion);
 
@@ -206,8 +507,19 @@ class EEPROMWearLevel: EEPROMClass {
        multiple times.
     */
     void updateControlBytes(int idx, int newStartIndex, int dataLength, const int controlBytesCount);
+    /**
+       returns the byte to program to the control byte at controlByteIndex to mark
+       the data from startIndexRelative to endIndexRelative as used. All relative
+       to the first data index.
+    */
+    byte getControlByteWriteMask(const int controlByteIndex, const int startIndexRelative,
+                                 const int endIndexRelative) const;
 
     int getControlBytesCount(const int index) const;
+    /**
+       counts a completed rotation of idx and persists it if persistRotations() is used.
+    */
+    void countRotation(const int idx);
     /**
        Finds the index by looking at the control bytes. All used bits are 0, all unused ones 1.
        controlBytesCount are passed in for optimization purpose to not calculate controlBytesCount
@@ -215,23 +527,24 @@ class EEPROMWearLevel: EEPROMClass {
     */
     int findIndex(const EEPROMConfig &config, const int controlBytesCount);
     /**
-       find the control byte where the current index is stored. That is the first byte
-       where not all bits are 0.
+       find the control byte where the current index is stored. That is the last byte
+       where not all bits are 1.
     */
     int findControlByteIndex(const int startIndex, const int length);
     /**
        read one byte from EEPROM.
     */
     inline byte readByte(const int index);
+    /**
+       writes the given bytes starting at startIndex. Bytes that only need bits
+       changed from 1 to 0, e.g. erased ones, are programmed without erasing them.
+    */
+    void writeBytes(const int startIndex, const byte *values, const int length);
 
     /**
        set one bit to 0 without erasing the whole byte before.
     */
     void programBitToZero(int index, byte bitIndex);
-    /**
-       Try retryCount times if EEPROM has not changed to expected value.
-    */
-    void programZeroBitsToZero(int index, byte byteWithZeros, int retryCount);
     /**
        set all bits that are 0 in byteWithZeros to zero without erasing the whole byte
        and without changing the bits that are 1 in byteWithZeros.
@@ -245,6 +558,17 @@ class EEPROMWearLevel: EEPROMClass {
        set all bits in the given byte to one with an erase operation.
     */
     void clearByteToOnes(int index);
+#ifdef NO_EEPROM_WRITES
+    /**
+       counts one operation on the fake EEPROM. Returns false if the power
+       is lost and the operation must not be executed.
+    */
+    bool fakeOperation();
+    /**
+       emulates a byte write with erase and program on the fake EEPROM.
+    */
+    void fakeWriteByte(int index, byte value);
+#endif
     /*
        print the given byte to print in binary with adding missing zeros on the left
        and in dec after a /.
@@ -256,34 +580,118 @@ class EEPROMWearLevel: EEPROMClass {
     */
     void logOutOfRange(int idx) const;
 
+    /**
+       reads the last written value of idx to values. Returns false and leaves
+       values unchanged if no value written yet.
+    */
+    bool getBytes(const int idx, byte *values, const int dataLength);
+    /**
+       write values to idx. If update is true, writting is only done
+       if the previous value was different.
+    */
+    void putBytes(const int idx, const byte *values, const int dataLength, const bool update);
+    /**
+       reads the first copy with a valid checksum to values and queues the repair of
+       all copies before it that are invalid. Returns false if no copy is valid.
+       The checksum is the last byte of values.
+    */
+    bool getRedundantBytes(const int idx, const int copies, byte *values, const int dataLength);
+    /**
+       returns the CRC-8 of values.
+    */
+    byte checksum(const byte *values, const int length) const;
+    /**
+       queues writing the value of sourceIdx to targetIdx in maintain().
+    */
+    void queueRepair(const int sourceIdx, const int targetIdx, const int dataLength);
+    /**
+       removes the queued repairs from or to idx.
+    */
+    void dequeueRepairs(const int idx);
+    /**
+       returns true if a repair has written some bytes of idx but not marked them yet.
+    */
+    bool isRepairInProgress(const int idx) const;
+    /**
+       writes the queued repairs one byte per budget check without a buffer in RAM.
+       Continues where the previous call stopped. Returns false if the budget was
+       too small.
+    */
+    bool repairCopies(const unsigned long startMicros, const unsigned long budgetMicros);
+    /**
+       decodes the series from fromIndex to toIndex and appends the values to values
+       at count after skipping skip values. Only counts them if values is NULL.
+       Returns the new count.
+    */
+    int decodeSamples(const int fromIndex, const int toIndex, int32_t values[], int count, int &skip);
+
+    void getKeyImpl(const char *key, byte *values, const int length);
+    void putKeyImpl(const char *key, const byte *values, const int length);
+    /**
+       calculates the 16 bit hash of key and the check byte to tell apart
+       keys with the same hash.
+    */
+    void hashKey(const char *key, uint16_t &keyHash, byte &keyCheck) const;
+    /**
+       returns the index in keyValueEntries of keyHash and keyCheck or of the
+       empty entry where they are added if not found.
+    */
+    int findKeyEntry(const uint16_t keyHash, const byte keyCheck) const;
+    /**
+       goes through all records of the key-value region idx. Returns true and sets
+       generation if it contains a commit record. If buildIndex is true, the hash
+       table is built from the records.
+    */
+    bool readKeyValueRegion(const int idx, byte &generation, const bool buildIndex);
+    /**
+       returns true if the current key-value region is almost full and compacting
+       it frees enough space or if a compaction is in progress.
+    */
+    bool isKeyValueCompactionDue();
+    /**
+       returns the length of the latest record of every key and the commit record.
+    */
+    int getKeyValueLiveLength();
+    /**
+       returns the index to append a record of recordLength to idx or ERROR_CODE
+       if it does not fit.
+    */
+    int getAppendIndex(const int idx, const int recordLength);
+    /**
+       appends a record with header and values to idx. Returns the start index of
+       the record or ERROR_CODE if it does not fit.
+    */
+    int appendRecord(const int idx, const byte *header, const byte *values, const int length);
+    /**
+       appends a record to idx one byte per budget check and marks it as used after
+       the last byte. Continues with the bytes written by the previous call if they
+       belong to the same record. The record is read from fromIndex if header is NULL.
+       Returns the start index of the record, NO_DATA if the budget was too small
+       or ERROR_CODE if it does not fit.
+    */
+    int writeRecord(const int idx, const int fromIndex, const byte *header, const byte *values,
+                    const int length, const unsigned long startMicros, const unsigned long budgetMicros);
+    /**
+       returns the worst case time in microseconds to mark dataLength bytes as used
+       in the control bytes.
+    */
+    unsigned long getMarkMicros(const int dataLength) const;
+    /**
+       copies the latest record of every key to the other region and switches to it
+       by appending a commit record with the next generation. Continues where the
+       previous call stopped. Returns false if the budget was too small or the other
+       region got full before the commit record was written.
+       If header is not NULL, the record of header and values is appended before the
+       commit record instead of copying the latest record of its key.
+    */
+    bool compactKeyValues(const unsigned long startMicros, const unsigned long budgetMicros,
+                          const byte *header = NULL, const byte *values = NULL, const int length = 0);
+
     // --------------------------------------------------------
     // implementation of template methods
     // --------------------------------------------------------
     template< typename T > T &getImpl(const int idx, T &t) {
-#ifndef NO_RANGE_CHECK
-      if (idx >= amountOfIndexes) {
-        logOutOfRange(idx);
-        return t;
-      }
-#endif
-      const int lastIndex = eepromConfig[idx].lastIndexRead;
-      if (lastIndex != NO_DATA) {
-        const int dataLength = sizeof(t);
-        // +1 because it is the last index
-        const int firstIndex = lastIndex + 1 - dataLength;
-#ifndef NO_EEPROM_WRITES
-        t = EEPROMClass::get(firstIndex, t);
-#else
-        byte *values = (byte*) &t;
-        for (int i = 0; i < dataLength; i++) {
-          values[i] = fakeEeprom[firstIndex + i];
-        }
-#endif
-      } else {
-#ifdef DEBUG_LOG
-        Serial.println(F("no data"));
-#endif
-      }
+      getBytes(idx, (byte*) &t, sizeof(t));
       return t;
     }
 
@@ -292,28 +700,33 @@ class EEPROMWearLevel: EEPROMClass {
        if the previous value was different.
     */
     template< typename T > const T &put(const int idx, const T &t, const bool update) {
-#ifndef NO_RANGE_CHECK
-      if (idx >= amountOfIndexes) {
-        logOutOfRange(idx);
-        return t;
+      putBytes(idx, (const byte*) &t, sizeof(t), update);
+      return t;
+    }
+
+    template< typename T > T &getRedundantImpl(const int idx, const int copies, T &t) {
+      // +1 for the checksum
+      byte buffer[sizeof(t) + 1];
+      if (getRedundantBytes(idx, copies, buffer, sizeof(buffer))) {
+        byte *values = (byte*) &t;
+        for (unsigned int i = 0; i < sizeof(t); i++) {
+          values[i] = buffer[i];
+        }
       }
-#endif
-      const int dataLength = sizeof(t);
-      const byte *values = (const byte*) &t;
-      const int controlBytesCount = getControlBytesCount(idx);
+      return t;
+    }
 
-      const int writeStartIndex = getWriteStartIndex(idx, dataLength, values, update, controlBytesCount);
-      if (writeStartIndex < 0) {
-        return t;
+    template< typename T > const T &putRedundantImpl(const int idx, const int copies, const T &t) {
+      // +1 for the checksum
+      byte buffer[sizeof(t) + 1];
+      const byte *values = (const byte*) &t;
+      for (unsigned int i = 0; i < sizeof(t); i++) {
+        buffer[i] = values[i];
       }
-#ifndef NO_EEPROM_WRITES
-      EEPROMClass::put(writeStartIndex, t);
-#else
-      for (int i = 0; i < dataLength; i++) {
-        fakeEeprom[writeStartIndex + i] = values[i];
+      buffer[sizeof(t)] = checksum(values, sizeof(t));
+      for (int copy = 0; copy < copies; copy++) {
+        putBytes(idx + copy, buffer, sizeof(buffer), true);
       }
-#endif
-      updateControlBytes(idx, writeStartIndex, dataLength, controlBytesCount);
       return t;
     }
 };
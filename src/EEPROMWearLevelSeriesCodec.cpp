@@ -0,0 +1,127 @@
+#include "EEPROMWearLevelSeriesCodec.h"
+
+/**
+   maps signed values to unsigned ones so that small negative values
+   have short varints: 0, -1, 1, -2, 2 .. become 0, 1, 2, 3, 4 ..
+*/
+static uint32_t zigZagEncode(const int32_t value) {
+	return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+
+static int32_t zigZagDecode(const uint32_t value) {
+	return (int32_t) ((value >> 1) ^ (0 - (value & 1)));
+}
+
+SeriesEncoder::SeriesEncoder(const int keyframeInterval) {
+	SeriesEncoder::keyframeInterval = keyframeInterval;
+	reset();
+}
+
+int SeriesEncoder::encode(const int32_t value, uint8_t *buffer) {
+	if (valuesSinceKeyframe < 0 || valuesSinceKeyframe >= keyframeInterval) {
+		return encodeKeyframe(value, buffer);
+	}
+	// calculated unsigned so that an overflow wraps the same way on decoding
+	const int32_t difference = (int32_t) ((uint32_t) value - (uint32_t) previousValue);
+	previousValue = value;
+	valuesSinceKeyframe++;
+	return encodeVarint(zigZagEncode(difference), buffer);
+}
+
+int SeriesEncoder::encodeKeyframe(const int32_t value, uint8_t *buffer, const bool wrapped) {
+	int markerLength = 0;
+	buffer[markerLength++] = 0x80;
+	if (wrapped) {
+		buffer[markerLength++] = 0x80;
+	}
+	buffer[markerLength++] = 0x00;
+	previousValue = value;
+	valuesSinceKeyframe = 1;
+	return markerLength + encodeVarint(zigZagEncode(value), buffer + markerLength);
+}
+
+void SeriesEncoder::reset() {
+	// negative to store a keyframe next
+	valuesSinceKeyframe = -1;
+	previousValue = 0;
+}
+
+int SeriesEncoder::encodeVarint(uint32_t value, uint8_t *buffer) const {
+	int length = 0;
+	// 7 bits per byte, the highest bit is set if more bytes follow
+	while (value >= 0x80) {
+		buffer[length] = (value & 0x7F) | 0x80;
+		value >>= 7;
+		length++;
+	}
+	buffer[length] = value;
+	return length + 1;
+}
+
+SeriesDecoder::SeriesDecoder() {
+	reset();
+}
+
+bool SeriesDecoder::decode(const uint8_t b, int32_t &value) {
+	if (markerStarted) {
+		if (b == 0x80 && shift == 7) {
+			// the second byte of the marker of a wrapped keyframe
+			shift = 14;
+			return false;
+		}
+		markerStarted = false;
+		if (b == 0x00) {
+			// the marker of a keyframe is complete, its value follows
+			keyframe = true;
+			varint = 0;
+			shift = 0;
+			return false;
+		}
+		// it was the first byte of a varint, continue with it
+	} else if (recordStart && b == 0x80) {
+		recordStart = false;
+		markerStarted = true;
+		shift = 7;
+		return false;
+	}
+	return decodeVarintByte(b, value);
+}
+
+void SeriesDecoder::reset() {
+	varint = 0;
+	shift = 0;
+	recordStart = true;
+	markerStarted = false;
+	keyframe = false;
+	synchronised = false;
+	previousValue = 0;
+}
+
+bool SeriesDecoder::decodeVarintByte(const uint8_t b, int32_t &value) {
+	if (shift < 32) {
+		varint |= (uint32_t) (b & 0x7F) << shift;
+	}
+	shift += 7;
+	if ((b & 0x80) != 0) {
+		// more bytes follow
+		recordStart = false;
+		return false;
+	}
+
+	const int32_t decoded = zigZagDecode(varint);
+	varint = 0;
+	shift = 0;
+	recordStart = true;
+	if (keyframe) {
+		keyframe = false;
+		synchronised = true;
+		previousValue = decoded;
+	} else if (synchronised) {
+		previousValue = (int32_t) ((uint32_t) previousValue + (uint32_t) decoded);
+	} else {
+		// no keyframe yet, skip it
+		return false;
+	}
+	value = previousValue;
+	return true;
+}
@@ -0,0 +1,117 @@
+/*
+    Copyright 2016-2016 Peter Rosenberg
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+/*
+  This file is part of the EEPROMWearLevel library for Arduino.
+  It does not depend on Arduino so that it can also be compiled on a host
+  to decode EEPROM dumps.
+*/
+
+#ifndef EEPROM_WEAR_LEVEL_SERIES_CODEC_H
+#define EEPROM_WEAR_LEVEL_SERIES_CODEC_H
+
+#include <stdint.h>
+
+/**
+   the maximum length of a single encoded value. That is a wrapped keyframe
+   with 3 bytes marker and 5 bytes varint.
+*/
+#define SERIES_MAX_RECORD_LENGTH 8
+
+/**
+   Encodes a series of values. Every value is stored as the difference to the
+   previous one in zig-zag varint encoding. Every keyframeInterval values, the value
+   itself is stored as keyframe so that decoding can start there.
+   A keyframe is the marker 0x80 0x00 followed by the zig-zag varint of the value.
+   The marker is a varint with a leading zero group what never occurs otherwise.
+   A wrapped keyframe uses the marker 0x80 0x80 0x00 to tell that older values of the
+   same series follow after the current position in a ring buffer.
+*/
+class SeriesEncoder {
+  public:
+    /**
+       @param keyframeInterval the amount of values after which a keyframe is stored.
+    */
+    SeriesEncoder(const int keyframeInterval);
+
+    /**
+       encodes value to buffer. buffer must have SERIES_MAX_RECORD_LENGTH bytes.
+       Returns the amount of bytes used in buffer.
+    */
+    int encode(const int32_t value, uint8_t *buffer);
+
+    /**
+       encodes value as keyframe to buffer. buffer must have SERIES_MAX_RECORD_LENGTH bytes.
+       Returns the amount of bytes used in buffer.
+       @param wrapped true to use the marker of a wrapped keyframe.
+    */
+    int encodeKeyframe(const int32_t value, uint8_t *buffer, const bool wrapped = false);
+
+    /**
+       makes the next value a keyframe.
+    */
+    void reset();
+
+  private:
+    int keyframeInterval;
+    int valuesSinceKeyframe;
+    int32_t previousValue;
+
+    int encodeVarint(uint32_t value, uint8_t *buffer) const;
+};
+
+/**
+   Decodes a series encoded by SeriesEncoder byte by byte. All bytes
+   before the first keyframe are skipped so decoding can start at any byte.
+*/
+class SeriesDecoder {
+  public:
+    SeriesDecoder();
+
+    /**
+       decodes the next byte. Returns true and sets value if a value is complete.
+    */
+    bool decode(const uint8_t b, int32_t &value);
+
+    /**
+       skips all bytes until the next keyframe.
+    */
+    void reset();
+
+  private:
+    uint32_t varint;
+    uint8_t shift;
+    /**
+       true if the next byte starts a new record.
+    */
+    bool recordStart;
+    /**
+       true if the record started with 0x80 what can be the start of the marker.
+    */
+    bool markerStarted;
+    /**
+       true if the current varint is the value of a keyframe.
+    */
+    bool keyframe;
+    /**
+       true if a keyframe was decoded so that differences can be applied.
+    */
+    bool synchronised;
+    int32_t previousValue;
+
+    bool decodeVarintByte(const uint8_t b, int32_t &value);
+};
+
+#endif // #ifndef EEPROM_WEAR_LEVEL_SERIES_CODEC_H
@@ -3,24 +3,130 @@
 #include <Arduino.h>
 #include "EEPROMWearLevel.h"
 
+// The NVM controller differs between the megaavr families. The _gc command
+// values are enum members in the device headers so the family is selected by
+// the device macros. DxCore and megaTinyCore also define the family macros.
+#if defined(__AVR_DA__) || defined(__AVR_DB__) || defined(__AVR_DD__) || defined(__AVR_DU__) \
+    || defined(__AVR_AVR128DA28__) || defined(__AVR_AVR128DA32__) || defined(__AVR_AVR128DA48__) || defined(__AVR_AVR128DA64__) \
+    || defined(__AVR_AVR64DA28__) || defined(__AVR_AVR64DA32__) || defined(__AVR_AVR64DA48__) || defined(__AVR_AVR64DA64__) \
+    || defined(__AVR_AVR32DA28__) || defined(__AVR_AVR32DA32__) || defined(__AVR_AVR32DA48__) \
+    || defined(__AVR_AVR128DB28__) || defined(__AVR_AVR128DB32__) || defined(__AVR_AVR128DB48__) || defined(__AVR_AVR128DB64__) \
+    || defined(__AVR_AVR64DB28__) || defined(__AVR_AVR64DB32__) || defined(__AVR_AVR64DB48__) || defined(__AVR_AVR64DB64__) \
+    || defined(__AVR_AVR32DB28__) || defined(__AVR_AVR32DB32__) || defined(__AVR_AVR32DB48__) \
+    || defined(__AVR_AVR64DD14__) || defined(__AVR_AVR64DD20__) || defined(__AVR_AVR64DD28__) || defined(__AVR_AVR64DD32__) \
+    || defined(__AVR_AVR32DD14__) || defined(__AVR_AVR32DD20__) || defined(__AVR_AVR32DD28__) || defined(__AVR_AVR32DD32__) \
+    || defined(__AVR_AVR16DD14__) || defined(__AVR_AVR16DD20__) || defined(__AVR_AVR16DD28__) || defined(__AVR_AVR16DD32__) \
+    || defined(__AVR_AVR64DU28__) || defined(__AVR_AVR64DU32__) || defined(__AVR_AVR32DU14__) || defined(__AVR_AVR32DU20__) \
+    || defined(__AVR_AVR32DU28__) || defined(__AVR_AVR32DU32__) || defined(__AVR_AVR16DU14__) || defined(__AVR_AVR16DU20__) \
+    || defined(__AVR_AVR16DU28__) || defined(__AVR_AVR16DU32__)
+#define EEPROM_NVM_DX
+#elif defined(__AVR_EA__) || defined(__AVR_EB__) \
+    || defined(__AVR_AVR64EA28__) || defined(__AVR_AVR64EA32__) || defined(__AVR_AVR64EA48__) \
+    || defined(__AVR_AVR32EA28__) || defined(__AVR_AVR32EA32__) || defined(__AVR_AVR32EA48__) \
+    || defined(__AVR_AVR16EA28__) || defined(__AVR_AVR16EA32__) || defined(__AVR_AVR16EA48__) \
+    || defined(__AVR_AVR8EA28__) || defined(__AVR_AVR8EA32__) \
+    || defined(__AVR_AVR16EB14__) || defined(__AVR_AVR16EB20__) || defined(__AVR_AVR16EB28__) || defined(__AVR_AVR16EB32__)
+#define EEPROM_NVM_EX
+#endif
+
+// The EEPROM is memory mapped on all megaavr parts. The device headers define
+// where it is mapped and how large it is. Fall back to the values of the
+// first megaavr parts in case an old toolchain does not define them.
+#if !defined(MAPPED_EEPROM_START) && defined(EEPROM_START)
+#define MAPPED_EEPROM_START EEPROM_START
+#endif
+#ifndef MAPPED_EEPROM_START
+#define MAPPED_EEPROM_START 0x1400
+#endif
+#ifndef EEPROM_SIZE
+#define EEPROM_SIZE 256
+#endif
+
+/**
+   returns the pointer to the memory mapped EEPROM byte at index.
+   All EEPROM sizes are a power of two so masking keeps the pointer
+   inside of the EEPROM.
+*/
+static inline byte *mappedEepromByte(int index) {
+  return (byte *) (MAPPED_EEPROM_START + (index & (EEPROM_SIZE - 1)));
+}
+
+#if defined(EEPROM_NVM_DX)
+// AVR Dx: no page buffer, the command is set first and the
+// write to the mapped address starts the operation.
+
+/**
+   executes command on the EEPROM byte at index.
+*/
+static void executeEepromCommand(int index, byte value, byte command) {
+  byte * dataptr = mappedEepromByte(index);
+
+  while (NVMCTRL.STATUS & NVMCTRL_EEBUSY_bm);  //make sure EEPROM is ready
+  uint8_t u8SREG = SREG;
+  cli();
+  _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_NONE_gc);
+  _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, command);
+  //writing the byte starts the operation
+  *dataptr = value;
+  SREG = u8SREG; //can reenable interrupts as soon as we do this...
+  while (NVMCTRL.STATUS & NVMCTRL_EEBUSY_bm);  //wait to be done
+  u8SREG = SREG;
+  cli();
+  _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_NONE_gc);
+  SREG = u8SREG;
+}
+
 #ifndef NO_EEPROM_WRITES
 void EEPROMWearLevel::programZeroBitsToZero(int index, byte byteWithZeros) {
-  // To write to page buffer get a pointer to that location in memory...
-  // on currently available megaavr parts, all have 256 or fewer b of EEPROM
-  // so we make sure we don't try to write somewhere not in the EEPROM
-  // only bytes changed in page buffer will be written when writing EEPROM
-  byte * dataptr = (byte *) (0x1400 | (0xFF & index));
+  // EEWR only programs bits to 0, it does not erase the byte before
+  executeEepromCommand(index, byteWithZeros, NVMCTRL_CMD_EEWR_gc);
+}
+#endif
+
+void EEPROMWearLevel::clearByteToOnes(int index) {
+  // EEBER erases a single byte, the written value is a dummy
+  executeEepromCommand(index, 0xFF, NVMCTRL_CMD_EEBER_gc);
+}
+
+#else
+// tinyAVR 0/1/2, megaAVR 0 and AVR Ex: the byte is written to the page
+// buffer and the command then writes or erases all loaded bytes.
+#if defined(EEPROM_NVM_EX)
+#define EEPROM_CMD_WRITE NVMCTRL_CMD_EEPW_gc
+#define EEPROM_CMD_ERASE NVMCTRL_CMD_EEPER_gc
+#else
+#define EEPROM_CMD_WRITE NVMCTRL_CMD_PAGEWRITE_gc
+#define EEPROM_CMD_ERASE NVMCTRL_CMD_PAGEERASE_gc
+#endif
+
+/**
+   loads value to the page buffer at index and executes command on it.
+*/
+static void executeEepromCommand(int index, byte value, byte command) {
+  // only bytes changed in page buffer will be written or erased
+  // when executing the command
+  byte * dataptr = mappedEepromByte(index);
 
   while (NVMCTRL.STATUS & NVMCTRL_EEBUSY_bm);  //make sure EEPROM is ready
   //Now just write the byte to that location...
-  *dataptr = byteWithZeros;
+  *dataptr = value;
   //disable interrupts
   uint8_t u8SREG = SREG;
   cli();
-  _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEWRITE_gc);
+  _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, command);
   SREG = u8SREG; //can reenable interrupts as soon as we do this...
-  while (NVMCTRL.STATUS & NVMCTRL_EEBUSY_bm);  //wait ti be done
-  //that byte has now been written successfully
+  while (NVMCTRL.STATUS & NVMCTRL_EEBUSY_bm);  //wait to be done
+#if defined(EEPROM_NVM_EX)
+  u8SREG = SREG;
+  cli();
+  _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_NOCMD_gc);
+  SREG = u8SREG;
+#endif
+}
+
+#ifndef NO_EEPROM_WRITES
+void EEPROMWearLevel::programZeroBitsToZero(int index, byte byteWithZeros) {
+  executeEepromCommand(index, byteWithZeros, EEPROM_CMD_WRITE);
 }
 #endif
 
@@ -28,17 +134,9 @@ void EEPROMWearLevel::clearByteToOnes(int index) {
   // To erase, same procedure as writing, only we write a dummy byte
   // to that location in the page buffer, which is cleared after every
   // operation, whether it is a write or an erase.
-  // only bytes changed in page buffer will be erased when erasing EEPROM
-  byte * dataptr = (byte *) (0x1400 | (0xFF & index));
-
-  while (NVMCTRL.STATUS & NVMCTRL_EEBUSY_bm);
-  *dataptr = 0xFF; //this is the dummy value
-  uint8_t u8SREG = SREG;
-  cli();
-  _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEERASE_gc); //just issue different command
-  SREG = u8SREG;
-  while (NVMCTRL.STATUS & NVMCTRL_EEBUSY_bm);
-  //that byte has now been erased successfully
+  executeEepromCommand(index, 0xFF, EEPROM_CMD_ERASE);
 }
 
+#endif // defined(EEPROM_NVM_DX)
+
 #endif // defined(ARDUINO_ARCH_MEGAAVR)
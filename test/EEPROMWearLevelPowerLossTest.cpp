@@ -0,0 +1,292 @@
+/*
+  Power loss sweep of EEPROMWearLevel on the fake EEPROM.
+  Every scenario writes some values and then cuts the power after every single
+  operation of the next write, one after the other. After the restart with begin(),
+  get() must return the previous or the new value and a further write must work.
+  The scenarios cover put() with updateControlBytes() and starting again at the
+  beginning of the partition as well as putKey() with the compaction in maintain()
+  in one call or in many calls with a small budget.
+  They run in parallel on all cores.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "EEPROMWearLevel.h"
+
+#define LAYOUT_VERSION 1
+#define NEIGHBOUR_VALUE 0x1234
+#define BIG_BUDGET 100000000UL
+// enough for a few bytes per call
+#define SMALL_BUDGET 10000UL
+
+enum ScenarioType {
+	PUT,
+	PUT_KEY
+};
+
+struct Scenario {
+	ScenarioType type;
+	int length;
+	int dataLength;
+	int writesBefore;
+	// the budget of maintain() for putKey()
+	unsigned long budgetMicros;
+};
+
+static std::vector<Scenario> scenarios;
+static std::atomic<int> nextScenario(0);
+static std::atomic<long> cuts(0);
+static std::atomic<int> failures(0);
+static std::mutex printMutex;
+
+static void fail(const Scenario &scenario, const long cut, const char *text) {
+	const int failure = ++failures;
+	if (failure <= 20) {
+		std::lock_guard<std::mutex> lock(printMutex);
+		printf("FAILED type %d length %d dataLength %d writesBefore %d budget %lu cut %ld: %s\n",
+		       scenario.type, scenario.length, scenario.dataLength, scenario.writesBefore,
+		       scenario.budgetMicros, cut, text);
+	}
+}
+
+// --------------------------------------------------------
+// put()
+// --------------------------------------------------------
+
+static std::vector<uint8_t> getWriteValue(const int write, const int dataLength) {
+	std::vector<uint8_t> value(dataLength);
+	for (int i = 0; i < dataLength; i++) {
+		value[i] = (write * 31 + i * 7 + 1) & 0xFF;
+	}
+	return value;
+}
+
+template< int N > void putN(EEPROMWearLevel &wl, const int idx, const std::vector<uint8_t> &value) {
+	uint8_t t[N];
+	memcpy(t, value.data(), N);
+	wl.put(idx, t);
+}
+
+template< int N > std::vector<uint8_t> getN(EEPROMWearLevel &wl, const int idx) {
+	// 0xA5 stays if no value is written yet
+	uint8_t t[N];
+	memset(t, 0xA5, N);
+	wl.get(idx, t);
+	return std::vector<uint8_t>(t, t + N);
+}
+
+static void putValue(EEPROMWearLevel &wl, const int idx, const std::vector<uint8_t> &value) {
+	switch (value.size()) {
+		case 1: putN<1>(wl, idx, value); break;
+		case 2: putN<2>(wl, idx, value); break;
+		case 4: putN<4>(wl, idx, value); break;
+		case 7: putN<7>(wl, idx, value); break;
+		default: putN<9>(wl, idx, value); break;
+	}
+}
+
+static std::vector<uint8_t> getValue(EEPROMWearLevel &wl, const int idx, const int dataLength) {
+	switch (dataLength) {
+		case 1: return getN<1>(wl, idx);
+		case 2: return getN<2>(wl, idx);
+		case 4: return getN<4>(wl, idx);
+		case 7: return getN<7>(wl, idx);
+		default: return getN<9>(wl, idx);
+	}
+}
+
+static void runPutScenario(const Scenario &scenario) {
+	// the partition under test between two others that must never change
+	const int lengths[] = {20, scenario.length, 20};
+	const int idx = 1;
+	const int dataLength = scenario.dataLength;
+	const int write = scenario.writesBefore;
+	const std::vector<uint8_t> noValue(dataLength, 0xA5);
+
+	for (long cut = 0;; cut++) {
+		EEPROMWearLevel *wl = new EEPROMWearLevel();
+		wl->begin(LAYOUT_VERSION, lengths, 3);
+		wl->put(0, (uint16_t) NEIGHBOUR_VALUE);
+		wl->put(2, (uint16_t) NEIGHBOUR_VALUE);
+		for (int i = 0; i < write; i++) {
+			putValue(*wl, idx, getWriteValue(i, dataLength));
+		}
+
+		// the cases where the control bytes are cleared before writing, see README.md
+		bool clearedBefore = write == 0;
+		if (write > 0) {
+			const int startIndexData = wl->getStartIndexEEPROM(idx);
+			const int previousStartIndex = wl->getCurrentIndexEEPROM(idx, dataLength);
+			const int previousLastIndex = previousStartIndex + dataLength - 1;
+			const bool startsAgain = previousLastIndex + 1 + dataLength > startIndexData + wl->getMaxDataLength(idx);
+			clearedBefore = startsAgain
+			                && (startIndexData + dataLength - 1 >= previousStartIndex
+			                    || (dataLength - 1) / 8 >= (previousLastIndex - startIndexData) / 8);
+		}
+
+		wl->simulatePowerLossAfter(cut);
+		putValue(*wl, idx, getWriteValue(write, dataLength));
+		const bool completed = wl->getOperationsUntilPowerLoss() > 0;
+		wl->simulatePowerLossAfter(NO_POWER_LOSS);
+		cuts++;
+
+		// restart of the device
+		wl->begin(LAYOUT_VERSION, lengths, 3);
+		const std::vector<uint8_t> value = getValue(*wl, idx, dataLength);
+		if (completed && value != getWriteValue(write, dataLength)) {
+			fail(scenario, cut, "new value expected after the write completed");
+		} else if (value != getWriteValue(write, dataLength)
+		           && !(write > 0 && value == getWriteValue(write - 1, dataLength))
+		           && !(clearedBefore && value == noValue)) {
+			fail(scenario, cut, "neither the previous nor the new value");
+		}
+		uint16_t neighbour = 0;
+		if (wl->get(0, neighbour) != NEIGHBOUR_VALUE || wl->get(2, neighbour) != NEIGHBOUR_VALUE) {
+			fail(scenario, cut, "other partition changed");
+		}
+		// the next write must work after the restart
+		putValue(*wl, idx, getWriteValue(write + 1, dataLength));
+		if (getValue(*wl, idx, dataLength) != getWriteValue(write + 1, dataLength)) {
+			fail(scenario, cut, "write after restart failed");
+		}
+		delete wl;
+		if (completed) {
+			return;
+		}
+	}
+}
+
+// --------------------------------------------------------
+// putKey()
+// --------------------------------------------------------
+
+#define KEY_COUNT 3
+static const char *keys[KEY_COUNT] = {"a", "bb", "ccc"};
+
+static void writeKey(EEPROMWearLevel &wl, const int write) {
+	wl.putKey(keys[write % KEY_COUNT], (int32_t) write);
+}
+
+static void runPutKeyScenario(const Scenario &scenario) {
+	const int lengths[] = {20, scenario.length, scenario.length};
+	const int write = scenario.writesBefore;
+	int32_t expected[KEY_COUNT];
+
+	for (long cut = 0;; cut++) {
+		EEPROMWearLevel *wl = new EEPROMWearLevel();
+		wl->begin(LAYOUT_VERSION, lengths, 3);
+		wl->put(0, (uint16_t) NEIGHBOUR_VALUE);
+		wl->beginKeyValue(1, KEY_COUNT);
+		for (int key = 0; key < KEY_COUNT; key++) {
+			expected[key] = -1;
+		}
+		for (int i = 0; i < write; i++) {
+			writeKey(*wl, i);
+			expected[i % KEY_COUNT] = i;
+			if (i % 4 == 3) {
+				wl->maintain(BIG_BUDGET);
+			}
+		}
+
+		// the write and the compaction it might cause, over several calls with a small budget
+		wl->simulatePowerLossAfter(cut);
+		writeKey(*wl, write);
+		for (int i = 0; i < 100 && !wl->maintain(scenario.budgetMicros); i++) {
+		}
+		const bool completed = wl->getOperationsUntilPowerLoss() > 0;
+		wl->simulatePowerLossAfter(NO_POWER_LOSS);
+		cuts++;
+
+		// restart of the device
+		wl->begin(LAYOUT_VERSION, lengths, 3);
+		wl->beginKeyValue(1, KEY_COUNT);
+		for (int key = 0; key < KEY_COUNT; key++) {
+			int32_t value = -1;
+			wl->getKey(keys[key], value);
+			if (key == write % KEY_COUNT) {
+				if (value != write && (completed || value != expected[key])) {
+					fail(scenario, cut, "neither the previous nor the new value of the key");
+				}
+			} else if (value != expected[key]) {
+				fail(scenario, cut, "other key changed");
+			}
+		}
+		uint16_t neighbour = 0;
+		if (wl->get(0, neighbour) != NEIGHBOUR_VALUE) {
+			fail(scenario, cut, "other partition changed");
+		}
+		// the next write must work after the restart
+		writeKey(*wl, write + 1);
+		int32_t value = -1;
+		if (wl->getKey(keys[(write + 1) % KEY_COUNT], value) != write + 1) {
+			fail(scenario, cut, "write after restart failed");
+		}
+		delete wl;
+		if (completed) {
+			return;
+		}
+	}
+}
+
+static void runScenarios() {
+	while (true) {
+		const int scenarioIndex = nextScenario++;
+		if (scenarioIndex >= (int) scenarios.size()) {
+			return;
+		}
+		const Scenario &scenario = scenarios[scenarioIndex];
+		if (scenario.type == PUT) {
+			runPutScenario(scenario);
+		} else {
+			runPutKeyScenario(scenario);
+		}
+	}
+}
+
+int main() {
+	// from a single control byte up to 9 control bytes
+	const int lengths[] = {9, 17, 30, 50, 79};
+	const int dataLengths[] = {1, 2, 4, 7, 9};
+	for (unsigned int l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+		const int length = lengths[l];
+		const int maxDataLength = length - (length + 8) / 9;
+		for (unsigned int d = 0; d < sizeof(dataLengths) / sizeof(dataLengths[0]); d++) {
+			const int dataLength = dataLengths[d];
+			if (dataLength > maxDataLength) {
+				continue;
+			}
+			// every position of the new value in the first two rotations
+			for (int writesBefore = 0; writesBefore <= 2 * (maxDataLength / dataLength) + 1; writesBefore++) {
+				const Scenario scenario = {PUT, length, dataLength, writesBefore, 0};
+				scenarios.push_back(scenario);
+			}
+		}
+	}
+	// records of 8 bytes, so compactions happen every few writes
+	for (int writesBefore = 0; writesBefore <= 40; writesBefore++) {
+		const Scenario scenario = {PUT_KEY, 40, 4, writesBefore, BIG_BUDGET};
+		scenarios.push_back(scenario);
+		const Scenario smallBudgetScenario = {PUT_KEY, 40, 4, writesBefore, SMALL_BUDGET};
+		scenarios.push_back(smallBudgetScenario);
+	}
+
+	unsigned int threadCount = std::thread::hardware_concurrency();
+	if (threadCount == 0) {
+		threadCount = 1;
+	}
+	std::vector<std::thread> threads;
+	for (unsigned int i = 0; i < threadCount; i++) {
+		threads.push_back(std::thread(runScenarios));
+	}
+	for (unsigned int i = 0; i < threads.size(); i++) {
+		threads[i].join();
+	}
+
+	printf("%d scenarios with %ld power losses on %u threads: %d failures\n",
+	       (int) scenarios.size(), cuts.load(), threadCount, failures.load());
+	return failures == 0 ? 0 : 1;
+}
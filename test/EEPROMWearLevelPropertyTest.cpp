@@ -0,0 +1,374 @@
+/*
+  Randomized property test of EEPROMWearLevel on the fake EEPROM.
+  Random sequences of begin(), put(), putToNext(), update(), write(), get() and
+  maintain() are compared against a reference map of the last written values.
+  Every write must stay within the erase and program operations a wear levelled
+  write needs at most. Two keys with the same hash must both keep their values
+  and maintain() must finish its work with a small budget over several calls
+  without losing the values of a compressed series.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <vector>
+#include "EEPROMWearLevel.h"
+
+#define LAYOUT_VERSION 1
+#define AMOUNT_OF_INDEXES 4
+#define SEEDS 200
+#define STEPS 2000
+#define BIG_BUDGET 100000000UL
+
+#define CHECK(condition) check(condition, #condition, __LINE__)
+
+struct Value5 {
+	uint8_t values[5];
+};
+
+// the data length of every idx
+static const int dataLengths[AMOUNT_OF_INDEXES] = {1, 2, 4, 5};
+
+static int failures = 0;
+static unsigned int currentSeed;
+static int currentStep;
+
+static void check(const bool condition, const char *text, const int line) {
+	if (!condition) {
+		failures++;
+		if (failures <= 20) {
+			printf("FAILED line %d seed %u step %d: %s\n", line, currentSeed, currentStep, text);
+		}
+	}
+}
+
+static int getControlBytesCount(const int length) {
+	// one bit per data byte, see EEPROMWearLevel::getControlBytesCount()
+	return (length + 8) / 9;
+}
+
+static void putValue(EEPROMWearLevel &wl, const int idx, const std::vector<uint8_t> &value, const bool update) {
+	switch (idx) {
+		case 0:
+			if (update) {
+				wl.update(idx, value[0]);
+			} else {
+				wl.write(idx, value[0]);
+			}
+			break;
+		case 1: {
+				uint16_t t;
+				memcpy(&t, value.data(), sizeof(t));
+				update ? wl.put(idx, t) : wl.putToNext(idx, t);
+				break;
+			}
+		case 2: {
+				uint32_t t;
+				memcpy(&t, value.data(), sizeof(t));
+				update ? wl.put(idx, t) : wl.putToNext(idx, t);
+				break;
+			}
+		default: {
+				Value5 t;
+				memcpy(&t, value.data(), sizeof(t));
+				update ? wl.put(idx, t) : wl.putToNext(idx, t);
+				break;
+			}
+	}
+}
+
+static std::vector<uint8_t> getValue(EEPROMWearLevel &wl, const int idx, const uint8_t initial) {
+	std::vector<uint8_t> value(dataLengths[idx], initial);
+	switch (idx) {
+		case 0:
+			if (initial == 0) {
+				// read() returns 0 if no value is written yet
+				value[0] = wl.read(idx);
+			} else {
+				wl.get(idx, value[0]);
+			}
+			break;
+		case 1: {
+				uint16_t t;
+				memcpy(&t, value.data(), sizeof(t));
+				wl.get(idx, t);
+				memcpy(value.data(), &t, sizeof(t));
+				break;
+			}
+		case 2: {
+				uint32_t t;
+				memcpy(&t, value.data(), sizeof(t));
+				wl.get(idx, t);
+				memcpy(value.data(), &t, sizeof(t));
+				break;
+			}
+		default: {
+				Value5 t;
+				memcpy(&t, value.data(), sizeof(t));
+				wl.get(idx, t);
+				memcpy(value.data(), &t, sizeof(t));
+				break;
+			}
+	}
+	return value;
+}
+
+static void runSeed(const unsigned int seed) {
+	currentSeed = seed;
+	srand(seed);
+
+	int lengths[AMOUNT_OF_INDEXES];
+	for (int idx = 0; idx < AMOUNT_OF_INDEXES; idx++) {
+		// from 9 bytes with a single control byte up to 60 bytes with 7 control bytes
+		lengths[idx] = 9 + rand() % 52;
+	}
+
+	EEPROMWearLevel *wl = new EEPROMWearLevel();
+	wl->begin(LAYOUT_VERSION, lengths, AMOUNT_OF_INDEXES);
+	std::map<int, std::vector<uint8_t> > reference;
+	// true if the next data bytes of idx are erased by maintain()
+	bool preErased[AMOUNT_OF_INDEXES] = {false};
+	bool writtenSinceBegin[AMOUNT_OF_INDEXES] = {false};
+
+	for (currentStep = 0; currentStep < STEPS; currentStep++) {
+		const int operation = rand() % 10;
+		const int idx = rand() % AMOUNT_OF_INDEXES;
+		if (operation < 6) {
+			// few different values so that update() often gets the same value
+			std::vector<uint8_t> value(dataLengths[idx]);
+			for (unsigned int i = 0; i < value.size(); i++) {
+				value[i] = rand() % 3 == 0 ? rand() % 256 : 0x0F;
+			}
+			const bool update = operation < 4;
+			const bool equal = reference.count(idx) > 0 && reference[idx] == value;
+			const unsigned long rotationsBefore = wl->getWearInfo(idx).rotations;
+			wl->resetOperationCounts();
+
+			putValue(*wl, idx, value, update);
+
+			const unsigned long erases = wl->getEraseCount();
+			const unsigned long programs = wl->getProgramCount();
+			const bool startedAgain = wl->getWearInfo(idx).rotations != rotationsBefore;
+			const int dataLength = dataLengths[idx];
+			if (update && equal) {
+				CHECK(erases == 0 && programs == 0);
+			} else {
+				// every data byte needs at most one erase and one program. When starting
+				// again at the beginning, every control byte is erased at most once.
+				unsigned long maxErases = dataLength;
+				if (startedAgain) {
+					maxErases += getControlBytesCount(lengths[idx]);
+				}
+				CHECK(erases <= maxErases);
+				// the control bytes of the data and one more if it is not aligned,
+				// each programmed at most twice if the verification fails
+				CHECK(programs <= (unsigned long) dataLength + 2 * (dataLength / 8 + 2));
+				if (preErased[idx] && !startedAgain) {
+					CHECK(erases == 0);
+				}
+				reference[idx] = value;
+				writtenSinceBegin[idx] = true;
+			}
+			preErased[idx] = false;
+		} else if (operation < 8) {
+			for (int i = 0; i < AMOUNT_OF_INDEXES; i++) {
+				wl->resetOperationCounts();
+				const std::vector<uint8_t> value = getValue(*wl, i, 0xA5);
+				CHECK(wl->getEraseCount() == 0 && wl->getProgramCount() == 0);
+				if (reference.count(i) > 0) {
+					CHECK(value == reference[i]);
+				} else {
+					// unchanged if no value written yet
+					CHECK(value == std::vector<uint8_t>(dataLengths[i], 0xA5));
+					CHECK(getValue(*wl, i, 0) == std::vector<uint8_t>(dataLengths[i], 0));
+				}
+			}
+		} else if (operation < 9) {
+			CHECK(wl->maintain(BIG_BUDGET));
+			for (int i = 0; i < AMOUNT_OF_INDEXES; i++) {
+				// only idx written since begin() know the length of the next write
+				preErased[i] = writtenSinceBegin[i];
+			}
+		} else {
+			// restart of the device
+			wl->begin(LAYOUT_VERSION, lengths, AMOUNT_OF_INDEXES);
+			for (int i = 0; i < AMOUNT_OF_INDEXES; i++) {
+				preErased[i] = false;
+				writtenSinceBegin[i] = false;
+			}
+		}
+	}
+	delete wl;
+}
+
+static void runKeyCollision() {
+	// "key6" and "key37" have the same 16 bit hash, both values must be kept
+	currentSeed = 0;
+	currentStep = 0;
+	const int lengths[] = {60, 60};
+	EEPROMWearLevel *wl = new EEPROMWearLevel();
+	wl->begin(LAYOUT_VERSION, lengths, 2);
+	wl->beginKeyValue(0, 4);
+	for (int32_t i = 0; i < 20; i++) {
+		wl->putKey("key6", i);
+		wl->putKey("key37", i + 100);
+		wl->maintain(BIG_BUDGET);
+	}
+	for (int restart = 0; restart < 2; restart++) {
+		int32_t value6 = -1;
+		int32_t value37 = -1;
+		CHECK(wl->getKey("key6", value6) == 19);
+		CHECK(wl->getKey("key37", value37) == 119);
+		wl->begin(LAYOUT_VERSION, lengths, 2);
+		wl->beginKeyValue(0, 4);
+	}
+	delete wl;
+}
+
+static void runSmallBudget() {
+	// a budget for only a few bytes must still compact the key-value store and
+	// erase the next bytes of the other idx
+	currentSeed = 0;
+	currentStep = 0;
+	const int lengths[] = {120, 120, 20};
+	EEPROMWearLevel *wl = new EEPROMWearLevel();
+	wl->begin(LAYOUT_VERSION, lengths, 3);
+	wl->beginKeyValue(0, 4);
+	// the next bytes of idx 2 are used by the first rotation
+	for (uint32_t i = 0; i < 5; i++) {
+		wl->put(2, i);
+	}
+	for (int32_t i = 0; i < 12; i++) {
+		wl->putKey("key", i);
+	}
+	const unsigned long rotationsBefore = wl->getWearInfo(1).rotations;
+	bool done = false;
+	for (int i = 0; i < 100 && !done; i++) {
+		done = wl->maintain(10000);
+	}
+	CHECK(done);
+	CHECK(wl->getWearInfo(1).rotations == rotationsBefore + 1);
+	wl->resetOperationCounts();
+	wl->put(2, (uint32_t) 5);
+	CHECK(wl->getEraseCount() == 0);
+	for (int restart = 0; restart < 2; restart++) {
+		int32_t value = -1;
+		CHECK(wl->getKey("key", value) == 11);
+		wl->begin(LAYOUT_VERSION, lengths, 3);
+		wl->beginKeyValue(0, 4);
+	}
+	delete wl;
+}
+
+static void runSmallBudgetRepair() {
+	// a value that needs more time to repair than the budget is repaired over
+	// several calls of maintain()
+	currentSeed = 0;
+	currentStep = 0;
+	const int lengths[] = {60, 60, 20};
+	EEPROMWearLevel *wl = new EEPROMWearLevel();
+	wl->begin(LAYOUT_VERSION, lengths, 3);
+	uint8_t value[24];
+	for (unsigned int i = 0; i < sizeof(value); i++) {
+		value[i] = i + 1;
+	}
+	wl->putRedundant(0, 2, value);
+	for (uint32_t i = 0; i < 5; i++) {
+		wl->put(2, i);
+	}
+	// the value and the checksum with a wrong checksum
+	uint8_t invalidCopy[sizeof(value) + 1];
+	memset(invalidCopy, 0x0F, sizeof(invalidCopy));
+	wl->put(0, invalidCopy);
+	uint8_t read[sizeof(value)];
+	memset(read, 0, sizeof(read));
+	wl->getRedundant(0, 2, read);
+	CHECK(memcmp(read, value, sizeof(value)) == 0);
+
+	bool done = false;
+	for (int i = 0; i < 100 && !done; i++) {
+		done = wl->maintain(20000);
+	}
+	CHECK(done);
+	wl->resetOperationCounts();
+	wl->put(2, (uint32_t) 5);
+	CHECK(wl->getEraseCount() == 0);
+	// only the first copy so it must be repaired
+	memset(read, 0, sizeof(read));
+	wl->getRedundant(0, 1, read);
+	CHECK(memcmp(read, value, sizeof(value)) == 0);
+	delete wl;
+}
+
+static void runPersistRotations() {
+	// calling persistRotations() again must not count the persisted rotations twice
+	currentSeed = 0;
+	currentStep = 0;
+	const int lengths[] = {20, 20};
+	EEPROMWearLevel *wl = new EEPROMWearLevel();
+	wl->begin(LAYOUT_VERSION, lengths, 2);
+	wl->persistRotations(0, 1);
+	// 17 data bytes, so every fifth value starts again at the beginning
+	for (uint32_t i = 0; i < 10; i++) {
+		wl->put(0, i);
+	}
+	CHECK(wl->getWearInfo(0).rotations == 2);
+	for (int restart = 0; restart < 2; restart++) {
+		wl->begin(LAYOUT_VERSION, lengths, 2);
+		wl->persistRotations(0, 1);
+		wl->persistRotations(0, 1);
+		CHECK(wl->getWearInfo(0).rotations == 2);
+	}
+	// counterIdx must not be idx
+	wl->persistRotations(1, 1);
+	wl->put(1, (uint32_t) 1);
+	CHECK(wl->getWearInfo(0).rotations == 2);
+	delete wl;
+}
+
+static void runSeriesMaintain() {
+	// maintain() must not erase the wrapped keyframe at the beginning of the partition
+	currentSeed = 0;
+	for (int length = 20; length <= 60; length++) {
+		const int lengths[] = {length};
+		EEPROMWearLevel *wl = new EEPROMWearLevel();
+		wl->begin(LAYOUT_VERSION, lengths, 1);
+		SeriesEncoder encoder(8);
+		std::vector<int32_t> written;
+		int sinceWrap = 0;
+		for (currentStep = 0; currentStep < 200; currentStep++) {
+			const unsigned long rotationsBefore = wl->getWearInfo(0).rotations;
+			// differences of one and two bytes
+			const int32_t value = 1000 + currentStep * (currentStep % 3 == 0 ? 100 : 3);
+			wl->putSample(0, encoder, value);
+			written.push_back(value);
+			sinceWrap = wl->getWearInfo(0).rotations != rotationsBefore ? 1 : sinceWrap + 1;
+			wl->maintain(BIG_BUDGET);
+
+			int32_t values[64];
+			const int count = wl->getSamples(0, values, 64);
+			// the latest values in order and at least all since starting again at the beginning
+			CHECK(count >= min(sinceWrap, 64));
+			bool suffix = count <= (int) written.size();
+			for (int j = 0; suffix && j < count; j++) {
+				suffix = values[j] == written[written.size() - count + j];
+			}
+			CHECK(suffix);
+		}
+		delete wl;
+	}
+}
+
+int main() {
+	for (unsigned int seed = 1; seed <= SEEDS; seed++) {
+		runSeed(seed);
+	}
+	runKeyCollision();
+	runSmallBudget();
+	runSmallBudgetRepair();
+	runPersistRotations();
+	runSeriesMaintain();
+	printf("%d seeds with %d steps: %d failures\n", SEEDS, STEPS, failures);
+	return failures == 0 ? 0 : 1;
+}
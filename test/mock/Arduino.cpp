@@ -0,0 +1,66 @@
+#include <chrono>
+#include <stdio.h>
+#include <Arduino.h>
+#include <EEPROM.h>
+
+Print Serial;
+EEPROMClass EEPROM;
+// not a member because EEPROMWearLevel extends EEPROMClass
+static uint8_t eeprom[MOCK_EEPROM_SIZE];
+
+unsigned long micros() {
+	static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+void Print::print(const char *value) {
+	printf("%s", value);
+}
+
+void Print::print(int value) {
+	printf("%d", value);
+}
+
+void Print::print(long value) {
+	printf("%ld", value);
+}
+
+void Print::print(unsigned long value) {
+	printf("%lu", value);
+}
+
+void Print::println() {
+	printf("\n");
+}
+
+void Print::println(const char *value) {
+	printf("%s\n", value);
+}
+
+void Print::println(int value) {
+	printf("%d\n", value);
+}
+
+void Print::println(long value) {
+	printf("%ld\n", value);
+}
+
+void Print::println(unsigned long value) {
+	printf("%lu\n", value);
+}
+
+uint8_t EEPROMClass::read(int index) {
+	return eeprom[index];
+}
+
+void EEPROMClass::write(int index, uint8_t value) {
+	eeprom[index] = value;
+}
+
+void EEPROMClass::update(int index, uint8_t value) {
+	eeprom[index] = value;
+}
+
+uint16_t EEPROMClass::length() {
+	return MOCK_EEPROM_SIZE;
+}
@@ -0,0 +1,42 @@
+/*
+  Minimal Arduino API to compile EEPROMWearLevel on a host for the tests.
+*/
+
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define F(string) (string)
+
+// functions instead of the Arduino macros so that they do not break the std headers
+template< typename T > T min(const T a, const T b) {
+  return a < b ? a : b;
+}
+
+template< typename T > T max(const T a, const T b) {
+  return a > b ? a : b;
+}
+
+unsigned long micros();
+
+class Print {
+  public:
+    void print(const char *value);
+    void print(int value);
+    void print(long value);
+    void print(unsigned long value);
+    void println();
+    void println(const char *value);
+    void println(int value);
+    void println(long value);
+    void println(unsigned long value);
+};
+
+extern Print Serial;
+
+#endif // #ifndef ARDUINO_H
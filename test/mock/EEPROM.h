@@ -0,0 +1,24 @@
+/*
+  Minimal EEPROM library to compile EEPROMWearLevel on a host for the tests.
+  The tests define NO_EEPROM_WRITES so EEPROMWearLevel uses its fake EEPROM
+  and this one is never written.
+*/
+
+#ifndef EEPROM_H
+#define EEPROM_H
+
+#include <Arduino.h>
+
+#define MOCK_EEPROM_SIZE 1024
+
+class EEPROMClass {
+  public:
+    uint8_t read(int index);
+    void write(int index, uint8_t value);
+    void update(int index, uint8_t value);
+    uint16_t length();
+};
+
+extern EEPROMClass EEPROM;
+
+#endif // #ifndef EEPROM_H